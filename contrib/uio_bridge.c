@@ -0,0 +1,875 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "uio_capture.h"
+#include "uio_ivshmem.h"
+#include "uio_ring.h"
+
+/*
+ * Socket bridge
+ *
+ * Every guest runs one bridge. Connections accepted on LISTEN are carried to
+ * the bridge of PEER, which opens its own connection to CONNECT, so that
+ * unmodified socket applications talk through the shared memory. Each
+ * connection owns a slot of the table at UIO_BRIDGE_OFFSET and the ring pair
+ * 2 * slot (initiator -> acceptor) and 2 * slot + 1 (acceptor -> initiator).
+ *
+ * Socket data goes straight between the socket and the ring memory with
+ * readv()/sendmsg(); Large sends use MSG_ZEROCOPY, in which case ring space
+ * is only released once the kernel reports the completion. Doorbells are
+ * batched: at most one per peer per loop iteration and only while that
+ * peer's bridge is asleep. With UIO_CAPTURE set, every readv()/sendmsg() that
+ * moved data is recorded like a ring write/read (see uio_capture.h).
+ */
+
+#define UIO_BRIDGE_MAGIC 0x47445242 /* "BRDG" */
+#define UIO_BRIDGE_CONNS 16
+#define UIO_BRIDGE_MAX_PEERS 16
+#define NR_RINGS (2 * UIO_BRIDGE_CONNS)
+
+#define ZC_MIN_SIZE 16384
+#define ZC_MAX_PENDING 64
+#define MAX_EVENTS 64
+#define WAIT_TIMEOUT_MS 100
+
+enum slot_state {
+  SLOT_FREE,
+  SLOT_RESERVED,   /* Initiator is setting it up */
+  SLOT_REQUEST,    /* Waiting for the acceptor */
+  SLOT_CONNECTING, /* Acceptor is connecting to its CONNECT endpoint */
+  SLOT_OPEN,
+  SLOT_REFUSED,
+};
+
+enum slot_side { SIDE_INITIATOR, SIDE_ACCEPTOR };
+
+struct bridge_slot {
+  _Alignas(64) _Atomic uint32_t state;
+  uint16_t initiator;
+  uint16_t acceptor;
+  _Atomic uint32_t shut[2]; /* Indexed by side; No more data from that side */
+  _Atomic uint32_t closed;  /* Number of sides that released the slot */
+};
+
+struct bridge_area {
+  _Alignas(64) _Atomic uint32_t magic;
+  struct {
+    _Alignas(64) _Atomic uint32_t sleeping;
+  } peer[UIO_BRIDGE_MAX_PEERS];
+  struct bridge_slot slot[UIO_BRIDGE_CONNS];
+};
+_Static_assert(sizeof(struct bridge_area) <= UIO_BRIDGE_SIZE,
+               "bridge table does not fit in its area");
+
+/* An address resolved once at startup, so that connecting never waits on DNS. */
+struct endpoint {
+  int family, protocol;
+  socklen_t addrlen;
+  struct sockaddr_storage addr;
+};
+
+struct conn {
+  int fd;
+  unsigned int idx;
+  enum slot_side side;
+  uint16_t peer;
+  struct uio_ring *tx, *rx;
+
+  int connecting;        /* Waiting for EPOLLOUT to finish the connect */
+  int rd_eof, tx_full;   /* Socket -> tx ring */
+  int wr_done, wr_block; /* rx ring -> socket */
+  size_t sent;           /* rx ring position handed to the kernel */
+  uint32_t events;
+
+  int zerocopy;
+  uint32_t zc_next, zc_nr, zc_first;
+  struct {
+    uint32_t id;
+    size_t release;
+  } zc_pending[ZC_MAX_PENDING];
+};
+
+struct bridge {
+  struct uio_ctrl *ctrl;
+  struct bridge_area *area;
+  struct ivshmem_reg *reg_ptr;
+  uint16_t me, peer;
+  int epfd, listen_fd, zerocopy;
+  const char *connect_spec;
+  struct endpoint connect_ep;
+  struct conn *conn[UIO_BRIDGE_CONNS][2];
+  uint64_t kick;
+  struct uio_ring *kick_ring[UIO_BRIDGE_MAX_PEERS]; /* Doorbells counted on */
+};
+
+int should_exit = 0;
+void sigterm_handler(int signum) { should_exit = 1; }
+
+static int endpoint_resolve(const char *spec, int listening,
+                            struct endpoint *ep) {
+  if (!strncmp(spec, "unix:", 5)) {
+    struct sockaddr_un *addr = (struct sockaddr_un *)&ep->addr;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, spec + 5, sizeof(addr->sun_path) - 1);
+    ep->family = AF_UNIX;
+    ep->protocol = 0;
+    ep->addrlen = sizeof(*addr);
+  } else if (!strncmp(spec, "tcp:", 4)) {
+    char host[256];
+    strncpy(host, spec + 4, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    char *port = strrchr(host, ':');
+    if (!port) {
+      errno = EINVAL;
+      return -1;
+    }
+    *port++ = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM,
+                             .ai_flags = listening ? AI_PASSIVE : 0};
+    struct addrinfo *res;
+    if (getaddrinfo(*host ? host : NULL, port, &hints, &res)) {
+      errno = EHOSTUNREACH;
+      return -1;
+    }
+    ep->family = res->ai_family;
+    ep->protocol = res->ai_protocol;
+    ep->addrlen = res->ai_addrlen;
+    memcpy(&ep->addr, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+  } else {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * A connecting socket is returned before the connection is established;
+ * EPOLLOUT tells when it is, and SO_ERROR whether it succeeded.
+ */
+static int endpoint_open(const struct endpoint *ep, int listening) {
+  int fd = socket(ep->family, SOCK_STREAM | SOCK_NONBLOCK, ep->protocol);
+  if (fd == -1)
+    return -1;
+
+  if (listening) {
+    int one = 1;
+    if (ep->family == AF_UNIX)
+      unlink(((struct sockaddr_un *)&ep->addr)->sun_path);
+    else
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&ep->addr, ep->addrlen) ||
+        listen(fd, SOMAXCONN))
+      goto out_close;
+  } else if (connect(fd, (struct sockaddr *)&ep->addr, ep->addrlen) &&
+             errno != EINPROGRESS)
+    goto out_close;
+  return fd;
+out_close:
+  close(fd);
+  return -1;
+}
+
+static void socket_tune(struct bridge *bridge, struct conn *conn) {
+  int one = 1;
+
+  /* Both fail harmlessly on UNIX sockets. */
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  conn->zerocopy = bridge->zerocopy &&
+                   !setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                               sizeof(one));
+}
+
+/* RING is the tx ring that the doorbell is for, if any. */
+static void kick_later(struct bridge *bridge, uint16_t peer,
+                       struct uio_ring *ring) {
+  bridge->kick |= 1ULL << (peer % UIO_BRIDGE_MAX_PEERS);
+  if (ring)
+    bridge->kick_ring[peer % UIO_BRIDGE_MAX_PEERS] = ring;
+}
+
+/* Ring the doorbell of every peer touched in this iteration that sleeps. */
+static void kick_flush(struct bridge *bridge) {
+  /*
+   * Orders the index stores of this iteration before the loads of sleeping:
+   * Otherwise a peer that sets sleeping and then rechecks its rings could
+   * miss both the data and the doorbell.
+   */
+  atomic_thread_fence(memory_order_seq_cst);
+  while (bridge->kick) {
+    int peer = __builtin_ctzll(bridge->kick);
+    bridge->kick &= bridge->kick - 1;
+
+    if (atomic_load_explicit(&bridge->area->peer[peer].sleeping,
+                             memory_order_seq_cst) &&
+        atomic_exchange_explicit(&bridge->area->peer[peer].sleeping, 0,
+                                 memory_order_seq_cst)) {
+      ivshmem_doorbell(bridge->reg_ptr, peer, DEFAULT_MSIX_INDEX);
+      if (bridge->kick_ring[peer])
+        uio_ring_count_doorbell(bridge->ctrl, bridge->kick_ring[peer],
+                                UIO_RING_PRODUCER);
+    }
+    bridge->kick_ring[peer] = NULL;
+  }
+}
+
+static void conn_update_events(struct bridge *bridge, struct conn *conn) {
+  uint32_t events = 0;
+
+  if (conn->connecting)
+    events = EPOLLOUT;
+  else if (!conn->rd_eof && !conn->tx_full)
+    events |= EPOLLIN;
+  if (conn->wr_block)
+    events |= EPOLLOUT;
+  if (events == conn->events)
+    return;
+
+  struct epoll_event ev = {.events = events, .data.ptr = conn};
+  if (epoll_ctl(bridge->epfd, EPOLL_CTL_MOD, conn->fd, &ev))
+    perror("epoll_ctl");
+  conn->events = events;
+}
+
+static struct conn *conn_create(struct bridge *bridge, int fd, unsigned int idx,
+                                enum slot_side side) {
+  struct bridge_slot *slot = &bridge->area->slot[idx];
+  struct conn *conn = calloc(1, sizeof(*conn));
+  if (!conn)
+    return NULL;
+
+  conn->fd = fd;
+  conn->idx = idx;
+  conn->side = side;
+  conn->peer = side == SIDE_INITIATOR ? slot->acceptor : slot->initiator;
+  conn->tx = &bridge->ctrl->ring[2 * idx + side];
+  conn->rx = &bridge->ctrl->ring[2 * idx + !side];
+  uio_ring_set_owner(bridge->ctrl, conn->tx, UIO_RING_PRODUCER, bridge->me);
+  uio_ring_set_owner(bridge->ctrl, conn->rx, UIO_RING_CONSUMER, bridge->me);
+  socket_tune(bridge, conn);
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+  if (epoll_ctl(bridge->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("epoll_ctl");
+    free(conn);
+    return NULL;
+  }
+  conn->events = EPOLLIN;
+
+  bridge->conn[idx][side] = conn;
+  return conn;
+}
+
+/* Release our side of the slot; The last side frees it. */
+static void slot_release(struct bridge *bridge, unsigned int idx,
+                         enum slot_side side) {
+  struct bridge_slot *slot = &bridge->area->slot[idx];
+
+  atomic_store_explicit(&slot->shut[side], 1, memory_order_release);
+  if (atomic_fetch_add_explicit(&slot->closed, 1, memory_order_acq_rel) == 1)
+    atomic_store_explicit(&slot->state, SLOT_FREE, memory_order_release);
+}
+
+static void conn_destroy(struct bridge *bridge, struct conn *conn) {
+  epoll_ctl(bridge->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  slot_release(bridge, conn->idx, conn->side);
+  kick_later(bridge, conn->peer, NULL);
+  bridge->conn[conn->idx][conn->side] = NULL;
+  free(conn);
+}
+
+static void conn_advance_tail(struct conn *conn, size_t release) {
+  atomic_store_explicit(&conn->rx->tail, release, memory_order_release);
+}
+
+/* MSG_ZEROCOPY completions: release the ring space of the finished sends. */
+static void conn_reap_zerocopy(struct conn *conn) {
+  for (;;) {
+    char control[128];
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof(control)};
+
+    if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+      return;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err *serr = (void *)CMSG_DATA(cm);
+      if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      /* The kernel had to copy anyway; Stop paying for the bookkeeping. */
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        conn->zerocopy = 0;
+
+      size_t release = 0;
+      int released = 0;
+      while (conn->zc_nr &&
+             (int32_t)(serr->ee_data -
+                       conn->zc_pending[conn->zc_first].id) >= 0) {
+        release = conn->zc_pending[conn->zc_first].release;
+        conn->zc_first = (conn->zc_first + 1) % ZC_MAX_PENDING;
+        --conn->zc_nr;
+        released = 1;
+      }
+      if (released)
+        conn_advance_tail(conn, release);
+    }
+  }
+}
+
+/* uio_ring_hook() for LEN bytes moved through IOV, which may wrap the ring. */
+static void conn_hook(struct bridge *bridge, struct uio_ring *ring,
+                      enum uio_ring_side side, const struct iovec *iov,
+                      size_t len, size_t head, size_t tail) {
+  char sample[UIO_CAPTURE_MAX_SAMPLE];
+  const void *buf = iov[0].iov_base;
+
+  if (len > iov[0].iov_len && iov[0].iov_len < sizeof(sample)) {
+    size_t rest = len - iov[0].iov_len;
+    if (rest > sizeof(sample) - iov[0].iov_len)
+      rest = sizeof(sample) - iov[0].iov_len;
+    memcpy(sample, iov[0].iov_base, iov[0].iov_len);
+    memcpy(sample + iov[0].iov_len, iov[1].iov_base, rest);
+    buf = sample;
+  }
+  uio_ring_hook(bridge->ctrl, ring, side, buf, len, head, tail);
+}
+
+/* Socket -> tx ring; Returns 1 on progress. */
+static int conn_pump_tx(struct bridge *bridge, struct conn *conn) {
+  struct uio_ring *ring = conn->tx;
+  size_t size = ring->size, mask = size - 1;
+
+  if (conn->rd_eof)
+    return 0;
+
+  struct uio_ring_counters *counters =
+      uio_ring_counters(bridge->ctrl, ring, UIO_RING_PRODUCER);
+  size_t free_space = uio_ring_free(ring);
+  if (!free_space) {
+    /* Counted once per stall, not on every retry while full. */
+    if (!conn->tx_full)
+      uio_stats_add(&counters->full, 1);
+    conn->tx_full = 1;
+    return 0;
+  }
+  conn->tx_full = 0;
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  char *real_buf = uio_ring_data(bridge->ctrl, ring);
+  size_t first_part = free_space < size - head ? free_space : size - head;
+  struct iovec iov[2] = {{real_buf + head, first_part},
+                         {real_buf, free_space - first_part}};
+
+  ssize_t n = readv(conn->fd, iov, iov[1].iov_len ? 2 : 1);
+  if (n > 0) {
+    atomic_store_explicit(&ring->head, (head + n) & mask, memory_order_release);
+    uio_stats_add(&counters->messages, 1);
+    uio_stats_add(&counters->bytes, n);
+    if (__builtin_expect(uio_ring_hook != NULL, 0))
+      conn_hook(bridge, ring, UIO_RING_PRODUCER, iov, n, (head + n) & mask,
+                atomic_load_explicit(&ring->tail, memory_order_relaxed));
+    return 1;
+  }
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+
+  /* EOF or error: The peer shuts down its socket once it drained the ring. */
+  conn->rd_eof = 1;
+  atomic_store_explicit(&bridge->area->slot[conn->idx].shut[conn->side], 1,
+                        memory_order_release);
+  return 1;
+}
+
+/* rx ring -> socket; Returns 1 on progress, -1 if the socket failed. */
+static int conn_pump_rx(struct bridge *bridge, struct conn *conn) {
+  struct uio_ring *ring = conn->rx;
+  size_t size = ring->size, mask = size - 1;
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t avail = (head + size - conn->sent) & mask;
+  if (!avail || conn->wr_done)
+    return 0;
+
+  char *real_buf = uio_ring_data(bridge->ctrl, ring);
+  size_t first_part = avail < size - conn->sent ? avail : size - conn->sent;
+  struct iovec iov[2] = {{real_buf + conn->sent, first_part},
+                         {real_buf, avail - first_part}};
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iov[1].iov_len ? 2 : 1};
+
+  int zerocopy = conn->zerocopy && avail >= ZC_MIN_SIZE &&
+                 conn->zc_nr < ZC_MAX_PENDING;
+  ssize_t n =
+      sendmsg(conn->fd, &msg,
+              MSG_DONTWAIT | MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+  if (n == -1 && zerocopy && (errno == ENOBUFS || errno == EFAULT)) {
+    /*
+     * ENOBUFS: Out of optmem for the notifications, copy this one only.
+     * EFAULT: The ring cannot be pinned (a PFNMAP BAR, e.g. with intel=1),
+     * so no send of this connection ever will.
+     */
+    if (errno == EFAULT)
+      conn->zerocopy = 0;
+    zerocopy = 0;
+    n = sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EINTR) {
+      conn->wr_block = 1;
+      return 0;
+    }
+    return -1;
+  }
+  conn->wr_block = 0;
+  conn->sent = (conn->sent + n) & mask;
+
+  struct uio_ring_counters *counters =
+      uio_ring_counters(bridge->ctrl, ring, UIO_RING_CONSUMER);
+  uio_stats_add(&counters->messages, 1);
+  uio_stats_add(&counters->bytes, n);
+  /* The tail recorded is what went to the kernel, zerocopy or not. */
+  if (__builtin_expect(uio_ring_hook != NULL, 0))
+    conn_hook(bridge, ring, UIO_RING_CONSUMER, iov, n, head, conn->sent);
+
+  if (zerocopy) {
+    unsigned int last = (conn->zc_first + conn->zc_nr) % ZC_MAX_PENDING;
+    conn->zc_pending[last].id = conn->zc_next++;
+    conn->zc_pending[last].release = conn->sent;
+    ++conn->zc_nr;
+  } else if (conn->zc_nr) {
+    /* Already copied; Released together with the last zerocopy send. */
+    unsigned int last = (conn->zc_first + conn->zc_nr - 1) % ZC_MAX_PENDING;
+    conn->zc_pending[last].release = conn->sent;
+  } else
+    conn_advance_tail(conn, conn->sent);
+  return 1;
+}
+
+/* Returns 1 on progress. */
+static int conn_pump(struct bridge *bridge, struct conn *conn) {
+  struct bridge_slot *slot = &bridge->area->slot[conn->idx];
+  uint32_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+  int progress = 0;
+
+  if (conn->connecting)
+    return 0;
+
+  if (conn->side == SIDE_INITIATOR && state == SLOT_REFUSED) {
+    fprintf(stderr, "[UIO] Connection #%u refused by %u\n", conn->idx,
+            conn->peer);
+    conn_destroy(bridge, conn);
+    return 1;
+  }
+
+  /* The other side is gone for good: Nobody will drain what we write. */
+  if (!conn->rd_eof &&
+      atomic_load_explicit(&slot->closed, memory_order_acquire))
+    conn->rd_eof = progress = 1;
+
+  progress |= conn_pump_tx(bridge, conn);
+  if (state == SLOT_OPEN) {
+    int ret = conn_pump_rx(bridge, conn);
+    if (ret < 0) {
+      conn_destroy(bridge, conn);
+      return 1;
+    }
+    progress |= ret;
+  }
+
+  /* Forward the EOF once everything before it went out. */
+  if (!conn->wr_done &&
+      atomic_load_explicit(&slot->shut[!conn->side], memory_order_acquire) &&
+      !conn->zc_nr &&
+      atomic_load_explicit(&conn->rx->head, memory_order_acquire) ==
+          conn->sent) {
+    shutdown(conn->fd, SHUT_WR);
+    conn->wr_done = 1;
+    progress = 1;
+  }
+
+  if (progress)
+    kick_later(bridge, conn->peer, conn->tx);
+
+  if (conn->rd_eof && conn->wr_done) {
+    conn_destroy(bridge, conn);
+    return 1;
+  }
+
+  conn_update_events(bridge, conn);
+  return progress;
+}
+
+static void bridge_accept(struct bridge *bridge) {
+  for (;;) {
+    int fd = accept4(bridge->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd == -1)
+      return;
+
+    unsigned int idx;
+    for (idx = 0; idx < UIO_BRIDGE_CONNS; ++idx) {
+      uint32_t state = SLOT_FREE;
+      if (atomic_compare_exchange_strong_explicit(
+              &bridge->area->slot[idx].state, &state, SLOT_RESERVED,
+              memory_order_acquire, memory_order_relaxed))
+        break;
+    }
+    if (idx == UIO_BRIDGE_CONNS) {
+      fprintf(stderr, "[UIO] No free connection slot\n");
+      close(fd);
+      continue;
+    }
+
+    struct bridge_slot *slot = &bridge->area->slot[idx];
+    slot->initiator = bridge->me;
+    slot->acceptor = bridge->peer;
+    atomic_store_explicit(&slot->shut[SIDE_INITIATOR], 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->shut[SIDE_ACCEPTOR], 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->closed, 0, memory_order_relaxed);
+    uio_ring_reset(&bridge->ctrl->ring[2 * idx]);
+    uio_ring_reset(&bridge->ctrl->ring[2 * idx + 1]);
+
+    if (!conn_create(bridge, fd, idx, SIDE_INITIATOR)) {
+      close(fd);
+      atomic_store_explicit(&slot->state, SLOT_FREE, memory_order_release);
+      continue;
+    }
+    atomic_store_explicit(&slot->state, SLOT_REQUEST, memory_order_release);
+    kick_later(bridge, bridge->peer, NULL);
+    fprintf(stderr, "[UIO] Connection #%u -> %u\n", idx, bridge->peer);
+  }
+}
+
+/* Returns 1 if any connection request was handled. */
+static int bridge_connect(struct bridge *bridge) {
+  int progress = 0;
+
+  if (!bridge->connect_spec)
+    return 0;
+
+  for (unsigned int idx = 0; idx < UIO_BRIDGE_CONNS; ++idx) {
+    struct bridge_slot *slot = &bridge->area->slot[idx];
+    uint32_t state = SLOT_REQUEST;
+
+    if (atomic_load_explicit(&slot->state, memory_order_acquire) != state ||
+        slot->acceptor != bridge->me ||
+        !atomic_compare_exchange_strong_explicit(
+            &slot->state, &state, SLOT_CONNECTING, memory_order_acquire,
+            memory_order_relaxed))
+      continue;
+
+    /* The slot stays CONNECTING until bridge_connected() sees EPOLLOUT. */
+    int fd = endpoint_open(&bridge->connect_ep, 0);
+    struct conn *conn =
+        fd == -1 ? NULL : conn_create(bridge, fd, idx, SIDE_ACCEPTOR);
+    if (!conn) {
+      perror("connect");
+      if (fd != -1)
+        close(fd);
+      atomic_store_explicit(&slot->state, SLOT_REFUSED, memory_order_release);
+      slot_release(bridge, idx, SIDE_ACCEPTOR);
+      kick_later(bridge, slot->initiator, NULL);
+    } else {
+      conn->connecting = 1;
+      conn_update_events(bridge, conn);
+    }
+    progress = 1;
+  }
+
+  return progress;
+}
+
+/* EPOLLOUT on a connecting socket: The connect finished, one way or another. */
+static void bridge_connected(struct bridge *bridge, struct conn *conn) {
+  struct bridge_slot *slot = &bridge->area->slot[conn->idx];
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+    err = errno;
+  if (err) {
+    errno = err;
+    perror("connect");
+    atomic_store_explicit(&slot->state, SLOT_REFUSED, memory_order_release);
+    conn_destroy(bridge, conn);
+    return;
+  }
+
+  conn->connecting = 0;
+  atomic_store_explicit(&slot->state, SLOT_OPEN, memory_order_release);
+  fprintf(stderr, "[UIO] Connection #%u <- %u\n", conn->idx, slot->initiator);
+  kick_later(bridge, conn->peer, NULL);
+  conn_update_events(bridge, conn);
+}
+
+/* Is there anything to do that no socket event would tell us about? */
+static int bridge_pending(struct bridge *bridge) {
+  for (unsigned int idx = 0; idx < UIO_BRIDGE_CONNS; ++idx) {
+    struct bridge_slot *slot = &bridge->area->slot[idx];
+    uint32_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+    if (bridge->connect_spec && state == SLOT_REQUEST &&
+        slot->acceptor == bridge->me)
+      return 1;
+
+    for (int side = 0; side < 2; ++side) {
+      struct conn *conn = bridge->conn[idx][side];
+      if (!conn || conn->connecting)
+        continue;
+
+      int shut = atomic_load_explicit(&slot->shut[!side], memory_order_acquire);
+      size_t head = atomic_load_explicit(&conn->rx->head, memory_order_acquire);
+      if ((state == SLOT_OPEN && head != conn->sent && !conn->wr_block) ||
+          (!conn->wr_done && shut && head == conn->sent && !conn->zc_nr) ||
+          (conn->tx_full && uio_ring_free(conn->tx)) ||
+          (side == SIDE_INITIATOR && state == SLOT_REFUSED) ||
+          (!conn->rd_eof &&
+           atomic_load_explicit(&slot->closed, memory_order_acquire)))
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Forget the connections a previous instance of us left behind. */
+static void bridge_reclaim(struct bridge *bridge) {
+  for (unsigned int idx = 0; idx < UIO_BRIDGE_CONNS; ++idx) {
+    struct bridge_slot *slot = &bridge->area->slot[idx];
+    uint32_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+    if (state == SLOT_FREE)
+      continue;
+
+    if (slot->initiator == bridge->me) {
+      if (state == SLOT_RESERVED) {
+        atomic_store_explicit(&slot->state, SLOT_FREE, memory_order_release);
+        continue;
+      }
+      slot_release(bridge, idx, SIDE_INITIATOR);
+    }
+
+    if (slot->acceptor == bridge->me) {
+      if (state == SLOT_CONNECTING)
+        atomic_store_explicit(&slot->state, SLOT_REFUSED,
+                              memory_order_release);
+      if (state == SLOT_CONNECTING || state == SLOT_OPEN)
+        slot_release(bridge, idx, SIDE_ACCEPTOR);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 6) {
+    fprintf(stderr, "Usage: %s FILE PEER LISTEN CONNECT ZEROCOPY\n", argv[0]);
+    fprintf(stderr, "  LISTEN/CONNECT: unix:PATH, tcp:[HOST]:PORT or -\n");
+    exit(EXIT_FAILURE);
+  }
+  const char *filename = argv[1];
+  struct bridge bridge = {
+      .peer = atoi(argv[2]),
+      .listen_fd = -1,
+      .connect_spec = strcmp(argv[4], "-") ? argv[4] : NULL,
+      .zerocopy = atoi(argv[5]),
+  };
+
+  fprintf(stderr, "[UIO] Opening file %s...", filename);
+  int fd = open(filename, O_RDWR | O_NONBLOCK);
+  if (fd == -1) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Mapping the file...");
+  size_t pagesize = getpagesize();
+  bridge.reg_ptr =
+      mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (bridge.reg_ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  size_t device_size = uio_ctrl_size(NR_RINGS, UIO_RING_SIZE);
+  void *device_mem = mmap(NULL, device_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  bridge.me = bridge.reg_ptr->ivposition;
+  if (bridge.me >= UIO_BRIDGE_MAX_PEERS ||
+      bridge.peer >= UIO_BRIDGE_MAX_PEERS) {
+    fprintf(stderr, "IVPositions must be below %d\n", UIO_BRIDGE_MAX_PEERS);
+    exit(EXIT_FAILURE);
+  }
+
+  bridge.ctrl = device_mem;
+  bridge.area = device_mem + UIO_BRIDGE_OFFSET;
+  int fresh = uio_ctrl_attach(bridge.ctrl, NR_RINGS, UIO_RING_SIZE, 0);
+  if (fresh < 0) {
+    fprintf(stderr, "%s holds a live layout with fewer than %d rings\n",
+            filename, NR_RINGS);
+    exit(EXIT_FAILURE);
+  }
+  if (fresh ||
+      atomic_load_explicit(&bridge.area->magic, memory_order_acquire) !=
+          UIO_BRIDGE_MAGIC) {
+    memset((void *)bridge.area + sizeof(bridge.area->magic), 0,
+           sizeof(*bridge.area) - sizeof(bridge.area->magic));
+    atomic_store_explicit(&bridge.area->magic, UIO_BRIDGE_MAGIC,
+                          memory_order_release);
+  } else
+    bridge_reclaim(&bridge);
+
+  int capturing = uio_capture_init(bridge.ctrl, bridge.me);
+  if (capturing < 0) {
+    perror("uio_capture_init");
+    exit(EXIT_FAILURE);
+  }
+  if (capturing)
+    fprintf(stderr, "[UIO] Capturing to %s\n\n", getenv("UIO_CAPTURE"));
+
+  fprintf(stderr, "[UIO] Setting up Epoll %s...", filename);
+  bridge.epfd = epoll_create1(0);
+  if (bridge.epfd == -1) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(bridge.epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+  if (bridge.connect_spec &&
+      endpoint_resolve(bridge.connect_spec, 0, &bridge.connect_ep)) {
+    perror(argv[4]);
+    exit(EXIT_FAILURE);
+  }
+  if (strcmp(argv[3], "-")) {
+    struct endpoint listen_ep;
+    if (endpoint_resolve(argv[3], 1, &listen_ep) ||
+        (bridge.listen_fd = endpoint_open(&listen_ep, 1)) == -1) {
+      perror(argv[3]);
+      exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &bridge.listen_fd;
+    if (epoll_ctl(bridge.epfd, EPOLL_CTL_ADD, bridge.listen_fd, &ev)) {
+      perror("epoll_ctl");
+      exit(EXIT_FAILURE);
+    }
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  signal(SIGINT, sigterm_handler);
+  signal(SIGTERM, sigterm_handler);
+
+  fprintf(stderr, "[UIO] Bridging %u <-> %u...\n\n", bridge.me, bridge.peer);
+
+  struct epoll_event events[MAX_EVENTS];
+  int nr_events = 0;
+  while (!should_exit) {
+    int progress = 0;
+
+    for (int i = 0; i < nr_events; ++i) {
+      if (!events[i].data.ptr) {
+        uint32_t value;
+        while (read(fd, &value, sizeof(value)) == sizeof(value))
+          ;
+      } else if (events[i].data.ptr == &bridge.listen_fd)
+        bridge_accept(&bridge);
+      else if (((struct conn *)events[i].data.ptr)->connecting)
+        bridge_connected(&bridge, events[i].data.ptr);
+      else if (events[i].events & EPOLLERR)
+        conn_reap_zerocopy(events[i].data.ptr);
+    }
+
+    progress |= bridge_connect(&bridge);
+    for (unsigned int idx = 0; idx < UIO_BRIDGE_CONNS; ++idx)
+      for (int side = 0; side < 2; ++side)
+        if (bridge.conn[idx][side])
+          progress |= conn_pump(&bridge, bridge.conn[idx][side]);
+    kick_flush(&bridge);
+
+    if (progress) {
+      nr_events = epoll_wait(bridge.epfd, events, MAX_EVENTS, 0);
+      continue;
+    }
+
+    /* Go to sleep, unless the peer did something right before we said so. */
+    atomic_store_explicit(&bridge.area->peer[bridge.me].sleeping, 1,
+                          memory_order_seq_cst);
+    nr_events = epoll_wait(bridge.epfd, events, MAX_EVENTS,
+                           bridge_pending(&bridge) ? 0 : WAIT_TIMEOUT_MS);
+    atomic_store_explicit(&bridge.area->peer[bridge.me].sleeping, 0,
+                          memory_order_relaxed);
+    if (nr_events == -1) {
+      if (errno != EINTR) {
+        perror("epoll_wait");
+        exit(EXIT_FAILURE);
+      }
+      nr_events = 0;
+    }
+  }
+  fprintf(stderr, "[UIO] Closing the connections...");
+  for (unsigned int idx = 0; idx < UIO_BRIDGE_CONNS; ++idx)
+    for (int side = 0; side < 2; ++side)
+      if (bridge.conn[idx][side])
+        conn_destroy(&bridge, bridge.conn[idx][side]);
+  kick_flush(&bridge);
+  if (bridge.listen_fd != -1)
+    close(bridge.listen_fd);
+  fprintf(stderr, " Done!\n\n");
+
+  if (capturing) {
+    fprintf(stderr, "[UIO] Flushing the capture...");
+    if (uio_capture_stop()) {
+      perror("uio_capture_stop");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, " Done! (records: %lu / dropped: %lu)\n\n",
+            uio_capture.records, uio_capture.dropped);
+  }
+
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, device_size) || munmap(bridge.reg_ptr, pagesize)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Closing the file...");
+  if (close(fd)) {
+    perror("close");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Exiting...\n\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,327 @@
+#ifndef UIO_CAPTURE_H
+#define UIO_CAPTURE_H
+
+/*
+ * Ring traffic capture
+ *
+ * With UIO_CAPTURE=PATH in the environment, uio_capture_init() hooks
+ * uio_ring_write()/uio_ring_read() so that every operation that moved data
+ * leaves a record: timestamp, ring, side, length, head/tail right after it
+ * and the first UIO_CAPTURE_SAMPLE (default 16) bytes of the payload.
+ * Timestamps are raw TSC ticks, which are cheaper than clock_gettime(); The
+ * header pairs them with uio_clock_now() at both ends of the capture, and
+ * keeps the IVPosition of the capturing peer with its latest clock estimate
+ * (see uio_clock.h) so that captures of different guests line up.
+ *
+ * The data path only appends the record to a private in-memory SPSC buffer;
+ * A writer thread moves the buffer into PATH, preallocated to
+ * UIO_CAPTURE_MB (default 256) MiB and mapped up front, so that neither
+ * syscalls nor page faults happen on the data path. Records that do not fit
+ * in the buffer or in the file are dropped and counted, never waited for.
+ * Only one thread per process may use the rings while capturing.
+ *
+ * The writer keeps the header current after every batch it moves, so that a
+ * capture cut short, even by SIGKILL, still decodes up to that batch;
+ * uio_capture_stop() only adds the last records and trims the file.
+ *
+ *   struct uio_capture_header
+ *   struct uio_capture_record, followed by its sample padded to 8 bytes
+ *   ...
+ *
+ * uio_capture_decode turns one or more such files back into timelines.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "uio_clock.h"
+#include "uio_ring.h"
+
+#define UIO_CAPTURE_MAGIC 0x50414355 /* "UCAP" */
+#define UIO_CAPTURE_VERSION 2
+#define UIO_CAPTURE_BUF_SIZE (16 << 20) /* Power of two */
+#define UIO_CAPTURE_MAX_SAMPLE 256
+#define UIO_CAPTURE_IDLE_US 1000
+
+struct uio_capture_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_size;
+  uint32_t nr_rings;
+  uint32_t sample; /* Payload bytes kept per record at most */
+  int64_t start_ns, stop_ns; /* uio_clock_now() at both ends */
+  uint64_t start_ticks, stop_ticks;
+  uint64_t data_len; /* Bytes of records after this header */
+  uint64_t records;
+  uint64_t dropped; /* Records lost to a full buffer or file */
+  uint16_t ivposition;
+  uint16_t reference; /* IVPosition whose clock CLOCK maps onto */
+  uint32_t has_clock; /* 0: No clock estimate was published */
+  struct uio_clock_estimate clock;
+  uint64_t reserved[1];
+};
+_Static_assert(sizeof(struct uio_capture_header) == 128,
+               "capture header must stay 128 bytes");
+
+struct uio_capture_record {
+  uint64_t ticks;  /* uio_capture_ticks() right after the operation */
+  uint8_t side;    /* enum uio_ring_side: write or read */
+  uint8_t ring;
+  uint16_t sample; /* Payload bytes following the record (unpadded) */
+  uint32_t len;    /* Bytes written or read */
+  uint32_t head;   /* Ring indices right after the operation */
+  uint32_t tail;
+};
+_Static_assert(sizeof(struct uio_capture_record) == 24,
+               "capture records must stay 24 bytes");
+
+static inline size_t uio_capture_record_size(uint16_t sample) {
+  return sizeof(struct uio_capture_record) + ((sample + 7) & ~7);
+}
+
+static inline uint64_t uio_capture_ticks(void) {
+#ifdef UIO_COPY_X86
+  return __builtin_ia32_rdtsc();
+#else
+  return uio_clock_now();
+#endif
+}
+
+static struct uio_capture {
+  /* Free-running byte positions in BUF */
+  _Alignas(64) _Atomic uint64_t head;
+  uint64_t tail_cache;       /* Last tail seen by the data path */
+  uint64_t budget;           /* Bytes of records the file can still take */
+  uint64_t records;          /* Owned by the data path */
+  _Atomic uint64_t dropped;  /* Likewise; Also read by the writer */
+  char *buf;
+  uint32_t sample;
+  _Alignas(64) _Atomic uint64_t tail; /* Owned by the writer */
+
+  int fd;
+  size_t file_size;
+  struct uio_capture_header *file;
+  struct uio_clock *clock;
+  _Atomic int stop;
+  pthread_t writer;
+} uio_capture;
+
+/* Copies LEN bytes into the private buffer at free-running position POS. */
+static inline void uio_capture_put(uint64_t pos, const void *src, size_t len) {
+  size_t mask = UIO_CAPTURE_BUF_SIZE - 1, off = pos & mask;
+  size_t first_part = len < UIO_CAPTURE_BUF_SIZE - off
+                          ? len
+                          : UIO_CAPTURE_BUF_SIZE - off;
+
+  memcpy(uio_capture.buf + off, src, first_part);
+  memcpy(uio_capture.buf, (const char *)src + first_part, len - first_part);
+}
+
+static void uio_capture_hook(struct uio_ctrl *ctrl, struct uio_ring *ring,
+                             enum uio_ring_side side, const void *buf,
+                             size_t len, size_t head, size_t tail) {
+  struct uio_capture_record rec = {
+      .ticks = uio_capture_ticks(),
+      .side = side,
+      .ring = ring - ctrl->ring,
+      .sample = len < uio_capture.sample ? len : uio_capture.sample,
+      .len = len,
+      .head = head,
+      .tail = tail,
+  };
+  size_t size = uio_capture_record_size(rec.sample);
+
+  uint64_t pos = atomic_load_explicit(&uio_capture.head, memory_order_relaxed);
+  if (pos + size - uio_capture.tail_cache > UIO_CAPTURE_BUF_SIZE)
+    uio_capture.tail_cache =
+        atomic_load_explicit(&uio_capture.tail, memory_order_acquire);
+  if (pos + size - uio_capture.tail_cache > UIO_CAPTURE_BUF_SIZE ||
+      size > uio_capture.budget) {
+    atomic_store_explicit(
+        &uio_capture.dropped,
+        atomic_load_explicit(&uio_capture.dropped, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    return;
+  }
+
+  size_t off = pos & (UIO_CAPTURE_BUF_SIZE - 1);
+  if (off + size <= UIO_CAPTURE_BUF_SIZE) {
+    memcpy(uio_capture.buf + off, &rec, sizeof(rec));
+    memcpy(uio_capture.buf + off + sizeof(rec), buf, rec.sample);
+  } else {
+    uio_capture_put(pos, &rec, sizeof(rec));
+    uio_capture_put(pos + sizeof(rec), buf, rec.sample);
+  }
+  uio_capture.budget -= size;
+  ++uio_capture.records;
+  atomic_store_explicit(&uio_capture.head, pos + size, memory_order_release);
+}
+
+static void *uio_capture_writer(void *arg) {
+  struct uio_capture_header *header = uio_capture.file;
+  char *data = (char *)(header + 1);
+  uint64_t written = 0, records = 0;
+
+  for (;;) {
+    int stop = atomic_load_explicit(&uio_capture.stop, memory_order_acquire);
+    uint64_t head =
+        atomic_load_explicit(&uio_capture.head, memory_order_acquire);
+    uint64_t tail =
+        atomic_load_explicit(&uio_capture.tail, memory_order_relaxed);
+
+    if (head == tail) {
+      if (stop)
+        break;
+      usleep(UIO_CAPTURE_IDLE_US);
+      continue;
+    }
+
+    size_t mask = UIO_CAPTURE_BUF_SIZE - 1, off = tail & mask;
+    size_t len = head - tail;
+    size_t first_part = len < UIO_CAPTURE_BUF_SIZE - off
+                            ? len
+                            : UIO_CAPTURE_BUF_SIZE - off;
+    memcpy(data + written, uio_capture.buf + off, first_part);
+    memcpy(data + written + first_part, uio_capture.buf, len - first_part);
+    atomic_store_explicit(&uio_capture.tail, head, memory_order_release);
+
+    for (uint64_t pos = written; pos < written + len; ++records)
+      pos += uio_capture_record_size(
+          ((struct uio_capture_record *)(data + pos))->sample);
+    written += len;
+
+    header->records = records;
+    header->dropped =
+        atomic_load_explicit(&uio_capture.dropped, memory_order_relaxed);
+    header->stop_ns = uio_clock_now();
+    header->stop_ticks = uio_capture_ticks();
+    header->data_len = written;
+  }
+
+  return (void *)(uintptr_t)written;
+}
+
+/* Keeps the newest estimate; The one from the start stays if none is left. */
+static inline void uio_capture_clock(struct uio_capture_header *header,
+                                     struct uio_clock *clock) {
+  if (atomic_load_explicit(&clock->magic, memory_order_acquire) !=
+          UIO_CLOCK_MAGIC ||
+      uio_clock_estimate(clock, header->ivposition, &header->clock))
+    return;
+  header->reference = clock->reference;
+  header->has_clock = 1;
+}
+
+/*
+ * Start capturing if UIO_CAPTURE is set; Returns 1 if capturing, 0 if not
+ * asked to, -1 on failure (with errno set). IVPOSITION is the peer's own.
+ */
+static inline int uio_capture_init(struct uio_ctrl *ctrl,
+                                   uint16_t ivposition) {
+  const char *path = getenv("UIO_CAPTURE");
+  if (!path || !*path)
+    return 0;
+
+  const char *env = getenv("UIO_CAPTURE_SAMPLE");
+  uio_capture.sample = env ? strtoul(env, NULL, 10) : 16;
+  if (uio_capture.sample > UIO_CAPTURE_MAX_SAMPLE)
+    uio_capture.sample = UIO_CAPTURE_MAX_SAMPLE;
+  env = getenv("UIO_CAPTURE_MB");
+  uio_capture.file_size = (env ? strtoul(env, NULL, 10) : 256) << 20;
+  if (uio_capture.file_size <= sizeof(struct uio_capture_header)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  uio_capture.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (uio_capture.fd == -1)
+    return -1;
+  if ((errno = posix_fallocate(uio_capture.fd, 0, uio_capture.file_size)))
+    goto out_close;
+  uio_capture.file =
+      mmap(NULL, uio_capture.file_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, uio_capture.fd, 0);
+  if (uio_capture.file == MAP_FAILED)
+    goto out_close;
+  uio_capture.buf = mmap(NULL, UIO_CAPTURE_BUF_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (uio_capture.buf == MAP_FAILED)
+    goto out_unmap;
+
+  *uio_capture.file = (struct uio_capture_header){
+      .magic = UIO_CAPTURE_MAGIC,
+      .version = UIO_CAPTURE_VERSION,
+      .ring_size = ctrl->ring[0].size,
+      .nr_rings = ctrl->nr_rings,
+      .sample = uio_capture.sample,
+      .start_ns = uio_clock_now(),
+      .start_ticks = uio_capture_ticks(),
+      .ivposition = ivposition,
+  };
+  uio_capture.clock = (void *)((char *)ctrl + UIO_CLOCK_OFFSET);
+  uio_capture_clock(uio_capture.file, uio_capture.clock);
+  uio_capture.budget =
+      uio_capture.file_size - sizeof(struct uio_capture_header);
+  atomic_store_explicit(&uio_capture.head, 0, memory_order_relaxed);
+  atomic_store_explicit(&uio_capture.tail, 0, memory_order_relaxed);
+  uio_capture.tail_cache = uio_capture.records = 0;
+  atomic_store_explicit(&uio_capture.dropped, 0, memory_order_relaxed);
+  atomic_store_explicit(&uio_capture.stop, 0, memory_order_relaxed);
+  if ((errno = pthread_create(&uio_capture.writer, NULL, uio_capture_writer,
+                              NULL)))
+    goto out_unmap_buf;
+
+  uio_ring_hook = uio_capture_hook;
+  return 1;
+
+out_unmap_buf:
+  munmap(uio_capture.buf, UIO_CAPTURE_BUF_SIZE);
+out_unmap:
+  munmap(uio_capture.file, uio_capture.file_size);
+out_close:
+  close(uio_capture.fd);
+  return -1;
+}
+
+/* Flush the capture and trim the file to what was recorded. */
+static inline int uio_capture_stop(void) {
+  void *written;
+
+  if (uio_ring_hook != uio_capture_hook)
+    return 0;
+  uio_ring_hook = NULL;
+
+  atomic_store_explicit(&uio_capture.stop, 1, memory_order_release);
+  if ((errno = pthread_join(uio_capture.writer, &written)))
+    return -1;
+
+  uio_capture.file->stop_ns = uio_clock_now();
+  uio_capture.file->stop_ticks = uio_capture_ticks();
+  uio_capture.file->data_len = (uintptr_t)written;
+  uio_capture.file->records = uio_capture.records;
+  uio_capture.file->dropped =
+      atomic_load_explicit(&uio_capture.dropped, memory_order_relaxed);
+  uio_capture_clock(uio_capture.file, uio_capture.clock);
+
+  size_t size = sizeof(struct uio_capture_header) + (uintptr_t)written;
+  int ret = msync(uio_capture.file, size, MS_SYNC);
+  munmap(uio_capture.buf, UIO_CAPTURE_BUF_SIZE);
+  munmap(uio_capture.file, uio_capture.file_size);
+  if (ftruncate(uio_capture.fd, size))
+    ret = -1;
+  if (close(uio_capture.fd))
+    ret = -1;
+  return ret;
+}
+
+#endif /* UIO_CAPTURE_H */
@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "uio_capture.h"
+
+/*
+ * Offline decoder for the files written with UIO_CAPTURE (see uio_capture.h)
+ *
+ * The records of all FILEs are merged by timestamp, so the producer and the
+ * consumer of a ring may be captured by different processes, or guests: If
+ * every FILE carries a clock estimate against the same reference (run
+ * uio_clocksync while capturing), timestamps are mapped onto the reference
+ * clock; Otherwise they stay local and only compare within one guest. MODE is
+ * one of:
+ *
+ *   dump       every record with its payload sample
+ *   occupancy  ring fill level after every operation
+ *   latency    per-message latency, from the write that completed a message
+ *              to the read that consumed its last byte, then a histogram
+ *
+ * Ring positions are unwrapped into byte offsets of the stream; Gaps left by
+ * dropped records are skipped over and reported.
+ */
+
+#define NR_BUCKETS 40 /* log2(ns); The last one catches everything above */
+
+enum mode { MODE_DUMP, MODE_OCCUPANCY, MODE_LATENCY };
+
+struct capture_file {
+  const char *name;
+  struct uio_capture_header *header;
+  size_t size;
+  const char *pos, *end;
+  double ns_per_tick;
+  int to_ref; /* Map onto the reference clock */
+};
+
+struct event {
+  int64_t end; /* Stream offset right after the operation */
+  int64_t ts_ns;
+  uint32_t len;
+};
+
+struct queue {
+  struct event *event;
+  size_t first, nr, capacity;
+};
+
+struct ring_state {
+  int seen[2];
+  int64_t pos[2]; /* Stream offset per side */
+  unsigned long long gaps[2];
+  struct queue writes, reads;
+
+  unsigned long long count, negative;
+  int64_t min_ns, max_ns, total_ns;
+  unsigned long long bucket[NR_BUCKETS];
+};
+
+static void queue_push(struct queue *queue, struct event event) {
+  if (queue->first + queue->nr == queue->capacity) {
+    if (queue->first) {
+      memmove(queue->event, queue->event + queue->first,
+              queue->nr * sizeof(*queue->event));
+      queue->first = 0;
+    } else {
+      queue->capacity = queue->capacity ? 2 * queue->capacity : 1024;
+      queue->event =
+          realloc(queue->event, queue->capacity * sizeof(*queue->event));
+      if (!queue->event) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  queue->event[queue->first + queue->nr++] = event;
+}
+
+static struct event *queue_front(struct queue *queue) {
+  return queue->nr ? &queue->event[queue->first] : NULL;
+}
+
+static void queue_pop(struct queue *queue) {
+  ++queue->first;
+  if (!--queue->nr)
+    queue->first = 0;
+}
+
+static void capture_open(struct capture_file *file, const char *name) {
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    perror(name);
+    exit(EXIT_FAILURE);
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    perror("fstat");
+    exit(EXIT_FAILURE);
+  }
+  if ((size_t)st.st_size < sizeof(struct uio_capture_header)) {
+    fprintf(stderr, "%s: Not a capture file\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  file->name = name;
+  file->size = st.st_size;
+  file->header = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (file->header == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  struct uio_capture_header *header = file->header;
+  if (header->magic != UIO_CAPTURE_MAGIC ||
+      header->version != UIO_CAPTURE_VERSION ||
+      header->data_len > file->size - sizeof(*header) ||
+      !header->ring_size || (header->ring_size & (header->ring_size - 1))) {
+    fprintf(stderr, "%s: Not a version %d capture file\n", name,
+            UIO_CAPTURE_VERSION);
+    exit(EXIT_FAILURE);
+  }
+  file->pos = (const char *)(header + 1);
+  file->end = file->pos + header->data_len;
+  file->ns_per_tick =
+      header->stop_ticks > header->start_ticks
+          ? (double)(header->stop_ns - header->start_ns) /
+                (header->stop_ticks - header->start_ticks)
+          : 1;
+  if (file->size > sizeof(*header) + header->data_len)
+    fprintf(stderr, "[UIO] %s: The capture was not stopped; Decoding up to "
+                    "its last flush\n",
+            name);
+
+  fprintf(stderr,
+          "[UIO] %s: IVPosition %u, %lu records, %lu dropped, %u rings of "
+          "%lu\n",
+          name, header->ivposition, header->records, header->dropped,
+          header->nr_rings, header->ring_size);
+}
+
+static const struct uio_capture_record *
+capture_peek(struct capture_file *file) {
+  if (file->end - file->pos < (ptrdiff_t)sizeof(struct uio_capture_record))
+    return NULL;
+
+  const struct uio_capture_record *rec = (const void *)file->pos;
+  if (file->end - file->pos < (ptrdiff_t)uio_capture_record_size(rec->sample))
+    return NULL;
+  return rec;
+}
+
+/* uio_clock_now() time of a record, on the reference clock if mapped */
+static int64_t capture_ns(const struct capture_file *file,
+                          const struct uio_capture_record *rec) {
+  int64_t local_ns =
+      file->header->start_ns +
+      (int64_t)((int64_t)(rec->ticks - file->header->start_ticks) *
+                file->ns_per_tick);
+
+  return file->to_ref ? uio_clock_to_ref(&file->header->clock, local_ns)
+                      : local_ns;
+}
+
+/* Use the reference clock only if every file can be mapped onto the same. */
+static void capture_align(struct capture_file *files, int nr_files) {
+  int to_ref = 1, guests = 0;
+
+  for (int i = 0; i < nr_files; ++i) {
+    const struct uio_capture_header *header = files[i].header;
+    if (!header->has_clock || header->reference != files[0].header->reference)
+      to_ref = 0;
+    if (header->ivposition != files[0].header->ivposition)
+      guests = 1;
+  }
+
+  if (to_ref)
+    fprintf(stderr, "[UIO] Timestamps on the clock of IVPosition %u\n",
+            files[0].header->reference);
+  else if (guests)
+    fprintf(stderr, "[UIO] Warning: No common clock estimate; Timestamps of "
+                    "different guests do not compare\n");
+  for (int i = 0; i < nr_files; ++i)
+    files[i].to_ref = to_ref;
+}
+
+static void latency_add(struct ring_state *state, int64_t latency_ns) {
+  if (latency_ns < 0) {
+    ++state->negative;
+    return;
+  }
+  if (!state->count || latency_ns < state->min_ns)
+    state->min_ns = latency_ns;
+  if (latency_ns > state->max_ns)
+    state->max_ns = latency_ns;
+  state->total_ns += latency_ns;
+  ++state->count;
+
+  int bucket = latency_ns ? 64 - __builtin_clzll(latency_ns) : 0;
+  ++state->bucket[bucket < NR_BUCKETS ? bucket : NR_BUCKETS - 1];
+}
+
+static void latency_print(const struct ring_state *state, unsigned int ring) {
+  printf("[ring #%u] count: %llu / negative: %llu\n", ring, state->count,
+         state->negative);
+  if (!state->count)
+    return;
+  printf("[ring #%u] min_ns: %ld / avg_ns: %ld / max_ns: %ld\n", ring,
+         state->min_ns, state->total_ns / (int64_t)state->count,
+         state->max_ns);
+  for (int i = 0; i < NR_BUCKETS; ++i)
+    if (state->bucket[i])
+      printf("[ring #%u] < %lld ns: %llu\n", ring, 1LL << i,
+             state->bucket[i]);
+}
+
+/* Pair every completed write with the read that consumed its last byte. */
+static void latency_match(struct ring_state *state, unsigned int ring,
+                          int64_t base_ns, enum mode mode) {
+  struct event *write, *read;
+
+  while ((write = queue_front(&state->writes)) &&
+         (read = queue_front(&state->reads))) {
+    if (read->end < write->end) {
+      queue_pop(&state->reads);
+      continue;
+    }
+    int64_t latency_ns = read->ts_ns - write->ts_ns;
+    if (mode == MODE_LATENCY)
+      printf("%ld %u %u %ld\n", write->ts_ns - base_ns, ring, write->len,
+             latency_ns);
+    latency_add(state, latency_ns);
+    queue_pop(&state->writes);
+  }
+}
+
+/* Places a record in the stream of its ring; Returns its start offset. */
+static int64_t stream_place(struct ring_state *state,
+                            const struct uio_capture_record *rec,
+                            int64_t size) {
+  int side = rec->side;
+  int64_t index = side == UIO_RING_PRODUCER ? rec->head : rec->tail;
+  int64_t before = (index - rec->len) & (size - 1);
+
+  if (!state->seen[side]) {
+    int64_t other = state->pos[!side];
+
+    state->seen[side] = 1;
+    if (!state->seen[!side])
+      state->pos[side] = before;
+    else if (side == UIO_RING_PRODUCER) /* Writes end at or after reads */
+      state->pos[side] = other - rec->len +
+                         ((before - other + rec->len) & (size - 1));
+    else /* Reads end at or before writes */
+      state->pos[side] = other - rec->len -
+                         ((other - rec->len - before) & (size - 1));
+  } else {
+    int64_t skipped = (before - state->pos[side]) & (size - 1);
+    if (skipped) {
+      ++state->gaps[side];
+      state->pos[side] += skipped;
+    }
+  }
+
+  int64_t start = state->pos[side];
+  state->pos[side] += rec->len;
+  return start;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s dump|occupancy|latency FILE...\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  enum mode mode;
+  if (!strcmp(argv[1], "dump"))
+    mode = MODE_DUMP;
+  else if (!strcmp(argv[1], "occupancy"))
+    mode = MODE_OCCUPANCY;
+  else if (!strcmp(argv[1], "latency"))
+    mode = MODE_LATENCY;
+  else {
+    fprintf(stderr, "Unknown MODE %s\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  int nr_files = argc - 2;
+  struct capture_file *files = calloc(nr_files, sizeof(*files));
+  struct ring_state *rings = calloc(UIO_RING_MAX, sizeof(*rings));
+  if (!files || !rings) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t ring_size = 0;
+  for (int i = 0; i < nr_files; ++i) {
+    capture_open(&files[i], argv[i + 2]);
+    if (ring_size && files[i].header->ring_size != ring_size) {
+      fprintf(stderr, "%s: Captured with another ring size\n", argv[i + 2]);
+      exit(EXIT_FAILURE);
+    }
+    ring_size = files[i].header->ring_size;
+  }
+  capture_align(files, nr_files);
+  fprintf(stderr, "\n");
+
+  int64_t base_ns = INT64_MAX;
+  for (int i = 0; i < nr_files; ++i) {
+    const struct uio_capture_header *header = files[i].header;
+    int64_t start_ns = files[i].to_ref
+                           ? uio_clock_to_ref(&header->clock, header->start_ns)
+                           : header->start_ns;
+    if (start_ns < base_ns)
+      base_ns = start_ns;
+  }
+
+  if (mode == MODE_DUMP)
+    printf("# time_ns file ring side len head tail sample\n");
+  else if (mode == MODE_OCCUPANCY)
+    printf("# time_ns ring side len used\n");
+  else
+    printf("# write_time_ns ring len latency_ns\n");
+
+  for (;;) {
+    const struct uio_capture_record *rec = NULL;
+    int64_t rec_ns = 0;
+    int from = -1;
+
+    for (int i = 0; i < nr_files; ++i) {
+      const struct uio_capture_record *next = capture_peek(&files[i]);
+      if (!next)
+        continue;
+      int64_t next_ns = capture_ns(&files[i], next);
+      if (!rec || next_ns < rec_ns) {
+        rec = next;
+        rec_ns = next_ns;
+        from = i;
+      }
+    }
+    if (!rec)
+      break;
+    files[from].pos += uio_capture_record_size(rec->sample);
+    if (rec->ring >= UIO_RING_MAX || rec->side > UIO_RING_CONSUMER)
+      continue;
+
+    const char *side = rec->side == UIO_RING_PRODUCER ? "tx" : "rx";
+    int64_t ts_ns = rec_ns - base_ns;
+    if (mode == MODE_DUMP) {
+      const uint8_t *sample = (const uint8_t *)(rec + 1);
+      printf("%ld %d %u %s %u %u %u ", ts_ns, from, rec->ring, side, rec->len,
+             rec->head, rec->tail);
+      for (unsigned int i = 0; i < rec->sample; ++i)
+        printf("%02x", sample[i]);
+      printf("\n");
+      continue;
+    }
+    if (mode == MODE_OCCUPANCY)
+      printf("%ld %u %s %u %lu\n", ts_ns, rec->ring, side, rec->len,
+             (rec->head - rec->tail) & (ring_size - 1));
+
+    struct ring_state *state = &rings[rec->ring];
+    int64_t start = stream_place(state, rec, ring_size);
+    struct event event = {start + rec->len, rec_ns, rec->len};
+    queue_push(rec->side == UIO_RING_PRODUCER ? &state->writes : &state->reads,
+               event);
+    latency_match(state, rec->ring, base_ns, mode);
+  }
+
+  if (mode == MODE_LATENCY)
+    for (unsigned int i = 0; i < UIO_RING_MAX; ++i) {
+      struct ring_state *state = &rings[i];
+      if (!state->seen[UIO_RING_PRODUCER] && !state->seen[UIO_RING_CONSUMER])
+        continue;
+      if (!state->seen[UIO_RING_PRODUCER] || !state->seen[UIO_RING_CONSUMER])
+        printf("[ring #%u] Only the %s side was captured\n", i,
+               state->seen[UIO_RING_PRODUCER] ? "producer" : "consumer");
+      if (state->gaps[0] || state->gaps[1])
+        printf("[ring #%u] gaps: %llu (tx) / %llu (rx)\n", i, state->gaps[0],
+               state->gaps[1]);
+      latency_print(state, i);
+    }
+
+  for (unsigned int i = 0; i < UIO_RING_MAX; ++i) {
+    free(rings[i].writes.event);
+    free(rings[i].reads.event);
+  }
+  free(rings);
+  for (int i = 0; i < nr_files; ++i)
+    munmap(files[i].header, files[i].size);
+  free(files);
+
+  return EXIT_SUCCESS;
+}
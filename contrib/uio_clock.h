@@ -0,0 +1,303 @@
+#ifndef UIO_CLOCK_H
+#define UIO_CLOCK_H
+
+/*
+ * Cross-VM clock alignment
+ *
+ * CLOCK_MONOTONIC of one guest means nothing to another, so every peer
+ * estimates the offset and drift of its clock against a reference peer by
+ * ping-pong through a per-peer mailbox in the clock area (UIO_CLOCK_OFFSET):
+ *
+ *   follower: t1 = now; req = n          reference: sees req == n
+ *                                                   ref_ns = now; resp = n
+ *   follower: sees resp == n; t3 = now
+ *
+ * Each round keeps the sample with the smallest round trip, whose offset is
+ * ref_ns - (t1 + t3) / 2, and fits the drift over the last few rounds. The
+ * result is published under a sequence counter so that any peer can map a
+ * timestamp of any other peer onto the reference clock, e.g. to turn ring
+ * message send timestamps into one-way latencies.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "uio_ring.h"
+
+#define UIO_CLOCK_MAGIC 0x4b4c4343 /* "CCLK" */
+#define UIO_CLOCK_MAX_PEERS 16
+#define UIO_CLOCK_WINDOW 16
+#define UIO_CLOCK_TIMEOUT_NS 1000000000LL
+
+struct uio_clock_peer {
+  /* Mailbox; Written by the follower */
+  _Alignas(64) _Atomic uint64_t req;
+
+  /* Mailbox; Written by the reference */
+  _Alignas(64) _Atomic uint64_t resp;
+  int64_t ref_ns;
+
+  /* Published estimate: ref = local + offset_ns + (local - base_ns) * drift */
+  _Alignas(64) _Atomic uint64_t seq;
+  int64_t base_ns;
+  int64_t offset_ns;
+  int64_t drift_ppb;
+  int64_t rtt_ns;
+};
+
+struct uio_clock {
+  _Alignas(64) _Atomic uint32_t magic;
+  uint32_t reference; /* IVPosition of the reference peer */
+
+  struct uio_clock_peer peer[UIO_CLOCK_MAX_PEERS];
+};
+_Static_assert(sizeof(struct uio_clock) <= UIO_CLOCK_SIZE,
+               "clock area does not fit in its area");
+
+struct uio_clock_estimate {
+  int64_t base_ns;
+  int64_t offset_ns;
+  int64_t drift_ppb;
+  int64_t rtt_ns;
+};
+
+/* Sample history of a follower (private memory) */
+struct uio_clock_history {
+  unsigned int nr, next;
+  double x[UIO_CLOCK_WINDOW]; /* Local time */
+  double y[UIO_CLOCK_WINDOW]; /* Offset to the reference */
+};
+
+static inline int64_t uio_clock_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Set the area up for REFERENCE unless it already is, with the same
+ * INITIALIZING/RECOVERING guard as uio_ctrl_attach(). An area that follows
+ * another reference is left alone, or its estimates would keep being wiped,
+ * unless RESET is set.
+ * Returns 1 if the area was (re)initialized, 0 if it was joined as is, -1 if
+ * it follows another reference.
+ */
+static inline int uio_clock_attach(struct uio_clock *clock, uint16_t reference,
+                                   int reset) {
+  uint32_t busy_magic = 0;
+  int64_t busy_since = 0;
+
+  for (;;) {
+    uint32_t magic = atomic_load_explicit(&clock->magic, memory_order_acquire);
+    int busy = magic == UIO_CTRL_INITIALIZING || magic == UIO_CTRL_RECOVERING;
+
+    /* Another peer is setting it up right now, unless it died doing so. */
+    if (busy && !reset) {
+      if (magic != busy_magic) {
+        busy_magic = magic;
+        busy_since = uio_clock_now();
+      }
+      if (uio_clock_now() - busy_since < UIO_CTRL_INIT_TIMEOUT_NS)
+        continue;
+    }
+    if (magic == UIO_CLOCK_MAGIC && !reset)
+      return clock->reference == reference ? 0 : -1;
+
+    uint32_t marker = magic == UIO_CTRL_INITIALIZING ? UIO_CTRL_RECOVERING
+                                                      : UIO_CTRL_INITIALIZING;
+    if (!atomic_compare_exchange_weak_explicit(&clock->magic, &magic, marker,
+                                               memory_order_acquire,
+                                               memory_order_relaxed))
+      continue;
+    clock->reference = reference;
+    for (unsigned int i = 0; i < UIO_CLOCK_MAX_PEERS; ++i) {
+      struct uio_clock_peer *peer = &clock->peer[i];
+
+      atomic_store_explicit(&peer->req, 0, memory_order_relaxed);
+      atomic_store_explicit(&peer->resp, 0, memory_order_relaxed);
+      atomic_store_explicit(&peer->seq, 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&clock->magic, UIO_CLOCK_MAGIC,
+                          memory_order_release);
+    return 1;
+  }
+}
+
+static inline void uio_clock_publish(struct uio_clock_peer *peer,
+                                     const struct uio_clock_estimate *est) {
+  uint64_t seq = atomic_load_explicit(&peer->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&peer->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  peer->base_ns = est->base_ns;
+  peer->offset_ns = est->offset_ns;
+  peer->drift_ppb = est->drift_ppb;
+  peer->rtt_ns = est->rtt_ns;
+  atomic_store_explicit(&peer->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Returns -1 if IVPOSITION has never published an estimate or has no
+ * mailbox (UIO_CLOCK_MAX_PEERS and above).
+ */
+static inline int uio_clock_estimate(struct uio_clock *clock,
+                                     uint16_t ivposition,
+                                     struct uio_clock_estimate *est) {
+  if (ivposition >= UIO_CLOCK_MAX_PEERS)
+    return -1;
+
+  struct uio_clock_peer *peer = &clock->peer[ivposition];
+  uint64_t seq;
+
+  do {
+    seq = atomic_load_explicit(&peer->seq, memory_order_acquire);
+    if (!seq)
+      return -1;
+    est->base_ns = peer->base_ns;
+    est->offset_ns = peer->offset_ns;
+    est->drift_ppb = peer->drift_ppb;
+    est->rtt_ns = peer->rtt_ns;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) ||
+           seq != atomic_load_explicit(&peer->seq, memory_order_relaxed));
+  return 0;
+}
+
+/* Map a local timestamp of the estimated peer onto the reference clock. */
+static inline int64_t uio_clock_to_ref(const struct uio_clock_estimate *est,
+                                       int64_t local_ns) {
+  return local_ns + est->offset_ns +
+         (local_ns - est->base_ns) * est->drift_ppb / 1000000000LL;
+}
+
+/* Reference side: answer every pending ping once; Returns the count. */
+static inline unsigned int uio_clock_serve(struct uio_clock *clock) {
+  unsigned int served = 0;
+
+  for (unsigned int i = 0; i < UIO_CLOCK_MAX_PEERS; ++i) {
+    struct uio_clock_peer *peer = &clock->peer[i];
+    uint64_t req = atomic_load_explicit(&peer->req, memory_order_acquire);
+
+    if (req == atomic_load_explicit(&peer->resp, memory_order_relaxed))
+      continue;
+    peer->ref_ns = uio_clock_now();
+    atomic_store_explicit(&peer->resp, req, memory_order_release);
+    ++served;
+  }
+  return served;
+}
+
+/*
+ * Follower side: one ping-pong exchange. Returns the round trip and stores
+ * the offset sample and its local midpoint, or -1 on timeout or if
+ * IVPOSITION has no mailbox.
+ */
+static inline int64_t uio_clock_ping(struct uio_clock *clock,
+                                     uint16_t ivposition, int64_t *offset_ns,
+                                     int64_t *mid_ns) {
+  if (ivposition >= UIO_CLOCK_MAX_PEERS)
+    return -1;
+
+  struct uio_clock_peer *peer = &clock->peer[ivposition];
+  uint64_t req = atomic_load_explicit(&peer->req, memory_order_relaxed) + 1;
+
+  int64_t t1 = uio_clock_now();
+  atomic_store_explicit(&peer->req, req, memory_order_release);
+  while (atomic_load_explicit(&peer->resp, memory_order_acquire) != req)
+    if (uio_clock_now() - t1 > UIO_CLOCK_TIMEOUT_NS)
+      return -1;
+  int64_t t3 = uio_clock_now();
+
+  *mid_ns = t1 + (t3 - t1) / 2;
+  *offset_ns = peer->ref_ns - *mid_ns;
+  return t3 - t1;
+}
+
+/*
+ * Follower side: one round of NR_PINGS exchanges. The best sample is added to
+ * HIST and the offset/drift fitted over HIST is stored in EST.
+ * Returns -1 if the reference did not answer.
+ */
+static inline int uio_clock_round(struct uio_clock *clock, uint16_t ivposition,
+                                  unsigned int nr_pings,
+                                  struct uio_clock_history *hist,
+                                  struct uio_clock_estimate *est) {
+  int64_t best_rtt = -1, best_offset = 0, best_mid = 0;
+
+  for (unsigned int i = 0; i < nr_pings; ++i) {
+    int64_t offset, mid;
+    int64_t rtt = uio_clock_ping(clock, ivposition, &offset, &mid);
+
+    if (rtt < 0)
+      return -1;
+    if (best_rtt < 0 || rtt < best_rtt) {
+      best_rtt = rtt;
+      best_offset = offset;
+      best_mid = mid;
+    }
+  }
+  if (best_rtt < 0)
+    return -1;
+
+  hist->x[hist->next] = best_mid;
+  hist->y[hist->next] = best_offset;
+  hist->next = (hist->next + 1) % UIO_CLOCK_WINDOW;
+  if (hist->nr < UIO_CLOCK_WINDOW)
+    ++hist->nr;
+
+  /* Least squares over the window, relative to the newest sample */
+  double mean_x = 0, mean_y = 0, sxx = 0, sxy = 0;
+  for (unsigned int i = 0; i < hist->nr; ++i) {
+    mean_x += hist->x[i] - best_mid;
+    mean_y += hist->y[i];
+  }
+  mean_x /= hist->nr;
+  mean_y /= hist->nr;
+  for (unsigned int i = 0; i < hist->nr; ++i) {
+    double dx = hist->x[i] - best_mid - mean_x;
+    sxx += dx * dx;
+    sxy += dx * (hist->y[i] - mean_y);
+  }
+  double slope = sxx > 0 ? sxy / sxx : 0;
+
+  est->base_ns = best_mid;
+  est->offset_ns = mean_y - slope * mean_x;
+  est->drift_ppb = slope * 1e9;
+  est->rtt_ns = best_rtt;
+  return 0;
+}
+
+/*
+ * Timestamped ring message header; SEND_NS is in the sender's local clock
+ * and LEN counts the payload that follows the header.
+ */
+struct uio_clock_stamp {
+  uint16_t ivposition;
+  uint16_t reserved;
+  uint32_t len;
+  uint64_t seq;
+  int64_t send_ns;
+};
+
+/*
+ * One-way latency of STAMP received at local time RECV_NS by RECEIVER.
+ * Returns 0 on success, -1 if either peer has no estimate (yet).
+ */
+static inline int uio_clock_one_way(struct uio_clock *clock,
+                                    const struct uio_clock_stamp *stamp,
+                                    uint16_t receiver, int64_t recv_ns,
+                                    int64_t *latency_ns) {
+  struct uio_clock_estimate send_est, recv_est;
+
+  if (uio_clock_estimate(clock, stamp->ivposition, &send_est) ||
+      uio_clock_estimate(clock, receiver, &recv_est))
+    return -1;
+
+  *latency_ns = uio_clock_to_ref(&recv_est, recv_ns) -
+                uio_clock_to_ref(&send_est, stamp->send_ns);
+  return 0;
+}
+
+#endif /* UIO_CLOCK_H */
@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "uio_clock.h"
+#include "uio_ivshmem.h"
+
+#define NR_PINGS 32
+
+int main(int argc, char *argv[]) {
+  if (argc != 5 && argc != 6) {
+    fprintf(stderr, "Usage: %s FILE REFERENCE ROUNDS INTERVAL_MS [RESET]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *filename = argv[1];
+  uint16_t reference = atoi(argv[2]);
+  size_t rounds = strtoul(argv[3], NULL, 10);
+  unsigned int interval_ms = atoi(argv[4]);
+  int reset = argc == 6 && atoi(argv[5]);
+
+  if (reference >= UIO_CLOCK_MAX_PEERS) {
+    fprintf(stderr, "REFERENCE must be below %d\n", UIO_CLOCK_MAX_PEERS);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "[UIO] Opening file %s...", filename);
+  int fd = open(filename, O_RDWR);
+  if (fd == -1) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Mapping the file...");
+  size_t pagesize = getpagesize();
+  struct ivshmem_reg *reg_ptr =
+      mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (reg_ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  /* The uio core only maps whole regions, so map BAR2 from its start. */
+  void *device_mem = mmap(NULL, UIO_RINGS_OFFSET, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  struct uio_clock *clock = device_mem + UIO_CLOCK_OFFSET;
+  fprintf(stderr, " Done!\n\n");
+
+  uint16_t ivposition = reg_ptr->ivposition;
+  if (ivposition >= UIO_CLOCK_MAX_PEERS) {
+    fprintf(stderr, "IVPosition %u is not below %d\n", ivposition,
+            UIO_CLOCK_MAX_PEERS);
+    exit(EXIT_FAILURE);
+  }
+  if (uio_clock_attach(clock, reference, reset) < 0) {
+    fprintf(stderr, "The clock area follows reference %u; Pass RESET to "
+                    "switch it to %u\n",
+            clock->reference, reference);
+    exit(EXIT_FAILURE);
+  }
+
+  if (ivposition == reference) {
+    /* The reference clock maps onto itself. */
+    struct uio_clock_estimate est = {.base_ns = uio_clock_now()};
+    uio_clock_publish(&clock->peer[ivposition], &est);
+
+    fprintf(stderr, "[UIO] Serving as the reference (%u)...", ivposition);
+    int64_t end_ns =
+        rounds ? uio_clock_now() + (int64_t)rounds * interval_ms * 1000000
+               : INT64_MAX;
+    while (uio_clock_now() < end_ns)
+      uio_clock_serve(clock);
+    fprintf(stderr, " Done!\n\n");
+  } else {
+    struct uio_clock_history hist = {0};
+
+    for (size_t i = 0; !rounds || i < rounds; ++i) {
+      struct uio_clock_estimate est;
+
+      if (uio_clock_round(clock, ivposition, NR_PINGS, &hist, &est)) {
+        fprintf(stderr, "[UIO] Reference %u is not responding\n", reference);
+        exit(EXIT_FAILURE);
+      }
+      uio_clock_publish(&clock->peer[ivposition], &est);
+      printf("[UIO] Round #%lu: offset_ns: %ld / drift_ppb: %ld / rtt_ns: "
+             "%ld\n",
+             i, est.offset_ns, est.drift_ppb, est.rtt_ns);
+
+      if (interval_ms)
+        usleep(interval_ms * 1000);
+    }
+    fprintf(stderr, "\n");
+  }
+
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, UIO_RINGS_OFFSET) || munmap(reg_ptr, pagesize)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Closing the file...");
+  if (close(fd)) {
+    perror("close");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Exiting...\n\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,282 @@
+#ifndef UIO_COPY_H
+#define UIO_COPY_H
+
+/*
+ * Copy kernels for the shared memory
+ *
+ * The same memcpy() is fast or very slow depending on how BAR2 is mapped
+ * (see README.md), so the ring and snapshot libraries copy through
+ * uio_copy.to_shmem/from_shmem, which uio_copy_init() picks from the memory
+ * type of the mapping and the CPU features:
+ *
+ *   WB (devm_memremap_pages(), simulated device)  prefetching plain copy
+ *   WC/UC (UIO_MEM_PHYS, intel=1)                 AVX-512/AVX2 non-temporal
+ *                                                 stores, MOVNTDQA loads
+ *
+ * UIO_IVSHMEM_MEMTYPE=wb|wc|uc overrides the detected memory type.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UIO_COPY_X86 1
+#endif
+
+#define UIO_COPY_PREFETCH_DIST 512
+
+enum uio_memtype { UIO_MEMTYPE_WB, UIO_MEMTYPE_WC, UIO_MEMTYPE_UC };
+
+typedef void *(*uio_copy_fn)(void *dst, const void *src, size_t len);
+
+static inline void *uio_copy_prefetch(void *dst, const void *src, size_t len) {
+  char *d = dst;
+  const char *s = src;
+
+  for (; len >= 64; len -= 64, d += 64, s += 64) {
+    __builtin_prefetch(s + UIO_COPY_PREFETCH_DIST, 0, 0);
+    memcpy(d, s, 64);
+  }
+  memcpy(d, s, len);
+  return dst;
+}
+
+#ifdef UIO_COPY_X86
+/* Non-temporal stores; For WC or uncached destinations */
+__attribute__((target("avx2"))) static inline void *
+uio_copy_nt_avx2(void *dst, const void *src, size_t len) {
+  char *d = dst;
+  const char *s = src;
+  size_t head = -(uintptr_t)d & 31;
+
+  head = head < len ? head : len;
+  memcpy(d, s, head);
+  d += head, s += head, len -= head;
+
+  for (; len >= 128; len -= 128, d += 128, s += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)s);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+    _mm256_stream_si256((__m256i *)d, a);
+    _mm256_stream_si256((__m256i *)(d + 32), b);
+    _mm256_stream_si256((__m256i *)(d + 64), c);
+    _mm256_stream_si256((__m256i *)(d + 96), e);
+  }
+  for (; len >= 32; len -= 32, d += 32, s += 32)
+    _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+  _mm_sfence();
+
+  memcpy(d, s, len);
+  return dst;
+}
+
+__attribute__((target("avx512f"))) static inline void *
+uio_copy_nt_avx512(void *dst, const void *src, size_t len) {
+  char *d = dst;
+  const char *s = src;
+  size_t head = -(uintptr_t)d & 63;
+
+  head = head < len ? head : len;
+  memcpy(d, s, head);
+  d += head, s += head, len -= head;
+
+  for (; len >= 256; len -= 256, d += 256, s += 256) {
+    __m512i a = _mm512_loadu_si512(s);
+    __m512i b = _mm512_loadu_si512(s + 64);
+    __m512i c = _mm512_loadu_si512(s + 128);
+    __m512i e = _mm512_loadu_si512(s + 192);
+    _mm512_stream_si512((__m512i *)d, a);
+    _mm512_stream_si512((__m512i *)(d + 64), b);
+    _mm512_stream_si512((__m512i *)(d + 128), c);
+    _mm512_stream_si512((__m512i *)(d + 192), e);
+  }
+  for (; len >= 64; len -= 64, d += 64, s += 64)
+    _mm512_stream_si512((__m512i *)d, _mm512_loadu_si512(s));
+  _mm_sfence();
+
+  memcpy(d, s, len);
+  return dst;
+}
+
+/* Streaming (MOVNTDQA) loads; For WC or uncached sources */
+__attribute__((target("sse4.1"))) static inline void *
+uio_copy_ntload_sse41(void *dst, const void *src, size_t len) {
+  char *d = dst;
+  const char *s = src;
+  size_t head = -(uintptr_t)s & 15;
+
+  head = head < len ? head : len;
+  memcpy(d, s, head);
+  d += head, s += head, len -= head;
+
+  for (; len >= 64; len -= 64, d += 64, s += 64) {
+    __m128i a = _mm_stream_load_si128((__m128i *)s);
+    __m128i b = _mm_stream_load_si128((__m128i *)(s + 16));
+    __m128i c = _mm_stream_load_si128((__m128i *)(s + 32));
+    __m128i e = _mm_stream_load_si128((__m128i *)(s + 48));
+    _mm_storeu_si128((__m128i *)d, a);
+    _mm_storeu_si128((__m128i *)(d + 16), b);
+    _mm_storeu_si128((__m128i *)(d + 32), c);
+    _mm_storeu_si128((__m128i *)(d + 48), e);
+  }
+  for (; len >= 16; len -= 16, d += 16, s += 16)
+    _mm_storeu_si128((__m128i *)d, _mm_stream_load_si128((__m128i *)s));
+
+  memcpy(d, s, len);
+  return dst;
+}
+
+__attribute__((target("avx2"))) static inline void *
+uio_copy_ntload_avx2(void *dst, const void *src, size_t len) {
+  char *d = dst;
+  const char *s = src;
+  size_t head = -(uintptr_t)s & 31;
+
+  head = head < len ? head : len;
+  memcpy(d, s, head);
+  d += head, s += head, len -= head;
+
+  for (; len >= 128; len -= 128, d += 128, s += 128) {
+    __m256i a = _mm256_stream_load_si256((const __m256i *)s);
+    __m256i b = _mm256_stream_load_si256((const __m256i *)(s + 32));
+    __m256i c = _mm256_stream_load_si256((const __m256i *)(s + 64));
+    __m256i e = _mm256_stream_load_si256((const __m256i *)(s + 96));
+    _mm256_storeu_si256((__m256i *)d, a);
+    _mm256_storeu_si256((__m256i *)(d + 32), b);
+    _mm256_storeu_si256((__m256i *)(d + 64), c);
+    _mm256_storeu_si256((__m256i *)(d + 96), e);
+  }
+  for (; len >= 32; len -= 32, d += 32, s += 32)
+    _mm256_storeu_si256((__m256i *)d,
+                        _mm256_stream_load_si256((const __m256i *)s));
+
+  memcpy(d, s, len);
+  return dst;
+}
+#endif /* UIO_COPY_X86 */
+
+struct uio_copy_kernel {
+  const char *name;
+  uio_copy_fn fn;
+  const char *feature; /* For __builtin_cpu_supports(); NULL if none */
+};
+
+/* Kernels in increasing order of preference for their use */
+static const struct uio_copy_kernel uio_copy_kernels[] = {
+    {"memcpy", memcpy, NULL},
+    {"prefetch", uio_copy_prefetch, NULL},
+#ifdef UIO_COPY_X86
+    {"nt_avx2", uio_copy_nt_avx2, "avx2"},
+    {"nt_avx512", uio_copy_nt_avx512, "avx512f"},
+    {"ntload_sse41", uio_copy_ntload_sse41, "sse4.1"},
+    {"ntload_avx2", uio_copy_ntload_avx2, "avx2"},
+#endif
+};
+#define UIO_COPY_NR_KERNELS                                                    \
+  (sizeof(uio_copy_kernels) / sizeof(uio_copy_kernels[0]))
+
+static struct {
+  const struct uio_copy_kernel *to_kernel, *from_kernel;
+  uio_copy_fn to_shmem, from_shmem;
+} uio_copy = {
+    &uio_copy_kernels[0], &uio_copy_kernels[0], memcpy, memcpy,
+};
+
+static inline int uio_copy_supported(const struct uio_copy_kernel *kernel) {
+  if (!kernel->feature)
+    return 1;
+#ifdef UIO_COPY_X86
+  __builtin_cpu_init();
+  if (!strcmp(kernel->feature, "avx2"))
+    return __builtin_cpu_supports("avx2");
+  if (!strcmp(kernel->feature, "avx512f"))
+    return __builtin_cpu_supports("avx512f");
+  if (!strcmp(kernel->feature, "sse4.1"))
+    return __builtin_cpu_supports("sse4.1");
+#endif
+  return 0;
+}
+
+static inline const struct uio_copy_kernel *uio_copy_find(const char *name) {
+  for (size_t i = 0; i < UIO_COPY_NR_KERNELS; ++i)
+    if (!strcmp(uio_copy_kernels[i].name, name))
+      return &uio_copy_kernels[i];
+  return NULL;
+}
+
+/* Returns the first supported kernel among NAMES (NULL-terminated). */
+static inline const struct uio_copy_kernel *
+uio_copy_pick(const char *const *names) {
+  for (; *names; ++names) {
+    const struct uio_copy_kernel *kernel = uio_copy_find(*names);
+    if (kernel && uio_copy_supported(kernel))
+      return kernel;
+  }
+  return &uio_copy_kernels[0];
+}
+
+static inline enum uio_memtype uio_memtype_detect(const char *filename) {
+  const char *env = getenv("UIO_IVSHMEM_MEMTYPE");
+  if (env) {
+    if (!strcmp(env, "wc"))
+      return UIO_MEMTYPE_WC;
+    if (!strcmp(env, "uc"))
+      return UIO_MEMTYPE_UC;
+    return UIO_MEMTYPE_WB;
+  }
+
+  /* Plain files (e.g. under /dev/shm) live in the page cache. */
+  struct stat st;
+  if (stat(filename, &st) || !S_ISCHR(st.st_mode))
+    return UIO_MEMTYPE_WB;
+
+  /* So does the shared memory of the simulated device. */
+  const char *name = strrchr(filename, '/');
+  char path[256], link[256];
+  snprintf(path, sizeof(path), "/sys/class/uio/%s/device",
+           name ? name + 1 : filename);
+  ssize_t len = readlink(path, link, sizeof(link) - 1);
+  if (len > 0) {
+    link[len] = '\0';
+    if (strstr(link, "uio_ivshmem_sim"))
+      return UIO_MEMTYPE_WB;
+  }
+
+  /* intel=1 leaves BAR2 to UIO_MEM_PHYS, which maps it uncached. */
+  int intel = 0;
+  FILE *file = fopen("/sys/module/uio_ivshmem/parameters/intel", "r");
+  if (file) {
+    if (fscanf(file, "%d", &intel) != 1)
+      intel = 0;
+    fclose(file);
+  }
+  return intel ? UIO_MEMTYPE_UC : UIO_MEMTYPE_WB;
+}
+
+static inline const char *uio_memtype_name(enum uio_memtype memtype) {
+  return memtype == UIO_MEMTYPE_UC   ? "uc"
+         : memtype == UIO_MEMTYPE_WC ? "wc"
+                                     : "wb";
+}
+
+static inline void uio_copy_init(enum uio_memtype memtype) {
+  static const char *const wb[] = {"prefetch", NULL};
+  static const char *const nt_to[] = {"nt_avx512", "nt_avx2", NULL};
+  static const char *const nt_from[] = {"ntload_avx2", "ntload_sse41", NULL};
+
+  uio_copy.to_kernel = uio_copy_pick(memtype == UIO_MEMTYPE_WB ? wb : nt_to);
+  uio_copy.from_kernel =
+      uio_copy_pick(memtype == UIO_MEMTYPE_WB ? wb : nt_from);
+  uio_copy.to_shmem = uio_copy.to_kernel->fn;
+  uio_copy.from_shmem = uio_copy.from_kernel->fn;
+}
+
+#endif /* UIO_COPY_H */
@@ -0,0 +1,81 @@
+#ifndef UIO_IVSHMEM_H
+#define UIO_IVSHMEM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+/* BAR0 register layout (mapped at offset 0 of the UIO device) */
+struct ivshmem_reg {
+  volatile uint32_t intrmask;
+  volatile uint32_t intrstatus;
+  volatile uint32_t ivposition;
+  volatile uint32_t doorbell;
+  volatile uint32_t ivlivelist;
+};
+
+#define DEFAULT_MSIX_INDEX 0
+
+static inline void ivshmem_doorbell(struct ivshmem_reg *reg_ptr,
+                                    uint16_t dest_ivposition,
+                                    uint16_t msi_index) {
+  reg_ptr->doorbell = (uint32_t)dest_ivposition << 16 | msi_index;
+}
+
+/*
+ * Size of BAR2 behind FILE, from sysfs for a UIO device and from the file
+ * size (minus the register page) for a plain file; Returns 0 if unknown.
+ */
+static inline size_t ivshmem_bar2_size(const char *filename) {
+  struct stat st;
+  if (stat(filename, &st))
+    return 0;
+  if (!S_ISCHR(st.st_mode))
+    return st.st_size > getpagesize() ? st.st_size - getpagesize() : 0;
+
+  const char *name = strrchr(filename, '/');
+  char path[256];
+  snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map1/size",
+           name ? name + 1 : filename);
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return 0;
+  unsigned long long size;
+  if (fscanf(file, "%llx", &size) != 1)
+    size = 0;
+  fclose(file);
+  return size;
+}
+
+/*
+ * Doorbell polling interval of the simulated device behind FILE in
+ * microseconds (0: busy polling); Returns -1 for any other device.
+ */
+static inline int ivshmem_sim_poll_us(const char *filename) {
+  const char *name = strrchr(filename, '/');
+  char path[256], link[256];
+  snprintf(path, sizeof(path), "/sys/class/uio/%s/device",
+           name ? name + 1 : filename);
+  ssize_t len = readlink(path, link, sizeof(link) - 1);
+  if (len <= 0)
+    return -1;
+  link[len] = '\0';
+  if (!strstr(link, "uio_ivshmem_sim"))
+    return -1;
+
+  int poll_us = -1;
+  FILE *file = fopen("/sys/module/uio_ivshmem/parameters/sim_poll_us", "r");
+  if (file) {
+    if (fscanf(file, "%d", &poll_us) != 1)
+      poll_us = -1;
+    fclose(file);
+  }
+  return poll_us;
+}
+
+#endif /* UIO_IVSHMEM_H */
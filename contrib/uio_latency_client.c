@@ -0,0 +1,153 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "uio_capture.h"
+#include "uio_clock.h"
+#include "uio_ivshmem.h"
+#include "uio_ring.h"
+
+volatile sig_atomic_t should_exit = 0;
+void sigterm_handler(int signum) { should_exit = 1; }
+
+int main(int argc, char *argv[]) {
+  if (argc != 7) {
+    fprintf(stderr, "Usage: %s FILE NR_RINGS RING COUNT SIZE INTERVAL_US\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *filename = argv[1];
+  unsigned int nr_rings = atoi(argv[2]);
+  unsigned int ring_idx = atoi(argv[3]);
+  size_t count = strtoul(argv[4], NULL, 10);
+  size_t size = strtoul(argv[5], NULL, 10);
+  __useconds_t interval_us = atoi(argv[6]);
+
+  if (ring_idx >= nr_rings) {
+    fprintf(stderr, "RING must be below NR_RINGS\n");
+    exit(EXIT_FAILURE);
+  }
+  if (sizeof(struct uio_clock_stamp) + size >= UIO_RING_SIZE) {
+    fprintf(stderr, "SIZE must be below %lu\n",
+            UIO_RING_SIZE - sizeof(struct uio_clock_stamp));
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "[UIO] Opening file %s...", filename);
+  int fd = open(filename, O_RDWR);
+  if (fd == -1) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Mapping the file...");
+  size_t pagesize = getpagesize();
+  struct ivshmem_reg *reg_ptr =
+      mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (reg_ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  size_t device_size = uio_ctrl_size(nr_rings, UIO_RING_SIZE);
+  void *device_mem = mmap(NULL, device_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  uio_copy_init(uio_memtype_detect(filename));
+  fprintf(stderr, "[UIO] Copy kernels: %s / %s\n\n", uio_copy.to_kernel->name,
+          uio_copy.from_kernel->name);
+
+  struct uio_ctrl *ctrl = device_mem;
+  int ret = uio_ctrl_attach(ctrl, nr_rings, UIO_RING_SIZE, 0);
+  if (ret == -1) {
+    fprintf(stderr, "NR_RINGS must be 1 ~ %d\n", UIO_RING_MAX);
+    exit(EXIT_FAILURE);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "%s holds a live layout with fewer than %u rings\n",
+            filename, nr_rings);
+    exit(EXIT_FAILURE);
+  }
+  struct uio_ring *ring_ptr = &ctrl->ring[ring_idx];
+  uio_ring_attach(ring_ptr, UIO_RING_PRODUCER);
+  uio_ring_set_owner(ctrl, ring_ptr, UIO_RING_PRODUCER, reg_ptr->ivposition);
+
+  int capturing = uio_capture_init(ctrl, reg_ptr->ivposition);
+  if (capturing < 0) {
+    perror("uio_capture_init");
+    exit(EXIT_FAILURE);
+  }
+  if (capturing)
+    fprintf(stderr, "[UIO] Capturing to %s\n\n", getenv("UIO_CAPTURE"));
+
+  /* Leave the loop below, so that the capture is flushed on the way out. */
+  signal(SIGINT, sigterm_handler);
+  signal(SIGTERM, sigterm_handler);
+
+  size_t msg_size = sizeof(struct uio_clock_stamp) + size;
+  struct uio_clock_stamp *stamp = calloc(1, msg_size);
+  if (!stamp) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  stamp->ivposition = reg_ptr->ivposition;
+  stamp->len = size;
+
+  fprintf(stderr, "[UIO] Sending %lu messages to ring #%u...", count,
+          ring_idx);
+  for (size_t i = 0; i < count; ++i) {
+    while (uio_ring_free(ring_ptr) < msg_size && !should_exit)
+      ;
+    if (should_exit)
+      break;
+    stamp->seq = i;
+    stamp->send_ns = uio_clock_now();
+    uio_ring_write(ctrl, ring_ptr, stamp, msg_size);
+
+    if (interval_us)
+      usleep(interval_us);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  free(stamp);
+
+  if (capturing) {
+    fprintf(stderr, "[UIO] Flushing the capture...");
+    if (uio_capture_stop()) {
+      perror("uio_capture_stop");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, " Done! (records: %lu / dropped: %lu)\n\n",
+            uio_capture.records, uio_capture.dropped);
+  }
+
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, device_size) || munmap(reg_ptr, pagesize)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Closing the file...");
+  if (close(fd)) {
+    perror("close");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Exiting...\n\n");
+
+  return EXIT_SUCCESS;
+}
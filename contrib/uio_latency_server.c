@@ -0,0 +1,189 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "uio_capture.h"
+#include "uio_clock.h"
+#include "uio_ivshmem.h"
+#include "uio_ring.h"
+
+#define NR_BUCKETS 40 /* log2(ns); The last one catches everything above */
+
+struct histogram {
+  unsigned long long count, unsynced, negative;
+  int64_t min_ns, max_ns, total_ns;
+  unsigned long long bucket[NR_BUCKETS];
+};
+
+static void histogram_add(struct histogram *hist, int64_t latency_ns) {
+  if (latency_ns < 0) {
+    ++hist->negative;
+    return;
+  }
+  if (!hist->count || latency_ns < hist->min_ns)
+    hist->min_ns = latency_ns;
+  if (latency_ns > hist->max_ns)
+    hist->max_ns = latency_ns;
+  hist->total_ns += latency_ns;
+  ++hist->count;
+
+  int bucket = latency_ns ? 64 - __builtin_clzll(latency_ns) : 0;
+  ++hist->bucket[bucket < NR_BUCKETS ? bucket : NR_BUCKETS - 1];
+}
+
+static void histogram_print(const struct histogram *hist, unsigned int ring) {
+  printf("[ring #%u] count: %llu / unsynced: %llu / negative: %llu\n", ring,
+         hist->count, hist->unsynced, hist->negative);
+  if (!hist->count)
+    return;
+  printf("[ring #%u] min_ns: %ld / avg_ns: %ld / max_ns: %ld\n", ring,
+         hist->min_ns, hist->total_ns / (int64_t)hist->count, hist->max_ns);
+  for (int i = 0; i < NR_BUCKETS; ++i)
+    if (hist->bucket[i])
+      printf("[ring #%u] < %lld ns: %llu\n", ring, 1LL << i, hist->bucket[i]);
+}
+
+volatile sig_atomic_t should_exit = 0;
+void sigterm_handler(int signum) { should_exit = 1; }
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s FILE NR_RINGS COUNT\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *filename = argv[1];
+  unsigned int nr_rings = atoi(argv[2]);
+  size_t count = strtoul(argv[3], NULL, 10);
+
+  fprintf(stderr, "[UIO] Opening file %s...", filename);
+  int fd = open(filename, O_RDWR);
+  if (fd == -1) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Mapping the file...");
+  size_t pagesize = getpagesize();
+  struct ivshmem_reg *reg_ptr =
+      mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (reg_ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  size_t device_size = uio_ctrl_size(nr_rings, UIO_RING_SIZE);
+  void *device_mem = mmap(NULL, device_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  uio_copy_init(uio_memtype_detect(filename));
+  fprintf(stderr, "[UIO] Copy kernels: %s / %s\n\n", uio_copy.to_kernel->name,
+          uio_copy.from_kernel->name);
+
+  struct uio_ctrl *ctrl = device_mem;
+  int ret = uio_ctrl_attach(ctrl, nr_rings, UIO_RING_SIZE, 0);
+  if (ret == -1) {
+    fprintf(stderr, "NR_RINGS must be 1 ~ %d\n", UIO_RING_MAX);
+    exit(EXIT_FAILURE);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "%s holds a live layout with fewer than %u rings\n",
+            filename, nr_rings);
+    exit(EXIT_FAILURE);
+  }
+  uint16_t ivposition = reg_ptr->ivposition;
+  for (unsigned int i = 0; i < nr_rings; ++i) {
+    uio_ring_attach(&ctrl->ring[i], UIO_RING_CONSUMER);
+    uio_ring_set_owner(ctrl, &ctrl->ring[i], UIO_RING_CONSUMER, ivposition);
+  }
+  struct uio_clock *clock = device_mem + UIO_CLOCK_OFFSET;
+
+  int capturing = uio_capture_init(ctrl, ivposition);
+  if (capturing < 0) {
+    perror("uio_capture_init");
+    exit(EXIT_FAILURE);
+  }
+  if (capturing)
+    fprintf(stderr, "[UIO] Capturing to %s\n\n", getenv("UIO_CAPTURE"));
+
+  /* Leave the loop below, so that the capture is flushed on the way out. */
+  signal(SIGINT, sigterm_handler);
+  signal(SIGTERM, sigterm_handler);
+
+  struct histogram *hist = calloc(nr_rings, sizeof(*hist));
+  char *payload = malloc(UIO_RING_SIZE);
+  if (!hist || !payload) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "[UIO] Receiving %lu messages...", count);
+  for (size_t received = 0; received < count && !should_exit;) {
+    for (unsigned int i = 0; i < nr_rings; ++i) {
+      struct uio_ring *ring_ptr = &ctrl->ring[i];
+      struct uio_clock_stamp stamp;
+
+      if (uio_ring_used(ring_ptr) < sizeof(stamp))
+        continue;
+      int64_t recv_ns = uio_clock_now();
+      uio_ring_read(ctrl, ring_ptr, &stamp, sizeof(stamp));
+      for (size_t len = 0; len < stamp.len;)
+        len += uio_ring_read(ctrl, ring_ptr, payload, stamp.len - len);
+
+      int64_t latency_ns;
+      if (uio_clock_one_way(clock, &stamp, ivposition, recv_ns, &latency_ns))
+        ++hist[i].unsynced;
+      else {
+        histogram_add(&hist[i], latency_ns);
+        uio_ring_count_latency(ctrl, ring_ptr, UIO_RING_CONSUMER, latency_ns);
+      }
+      ++received;
+    }
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  for (unsigned int i = 0; i < nr_rings; ++i)
+    if (hist[i].count || hist[i].unsynced || hist[i].negative)
+      histogram_print(&hist[i], i);
+
+  free(payload);
+  free(hist);
+
+  if (capturing) {
+    fprintf(stderr, "[UIO] Flushing the capture...");
+    if (uio_capture_stop()) {
+      perror("uio_capture_stop");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, " Done! (records: %lu / dropped: %lu)\n\n",
+            uio_capture.records, uio_capture.dropped);
+  }
+
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, device_size) || munmap(reg_ptr, pagesize)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Closing the file...");
+  if (close(fd)) {
+    perror("close");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Exiting...\n\n");
+
+  return EXIT_SUCCESS;
+}
@@ -9,6 +9,8 @@
 
 #include <sys/mman.h>
 
+#include "uio_copy.h"
+
 double gettimediff(const struct timespec *start, const struct timespec *end) {
   return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
 }
@@ -94,6 +96,35 @@ int main(int argc, char *argv[]) {
   elapsed_sec = gettimediff(&start, &end);
   printf("[device_mem] (memtest) elapsed_sec: %.6f\n", elapsed_sec);
 
+  enum uio_memtype memtype = uio_memtype_detect(path);
+  uio_copy_init(memtype);
+  printf("[device_mem] (memtype) %s / to: %s / from: %s\n",
+         uio_memtype_name(memtype), uio_copy.to_kernel->name,
+         uio_copy.from_kernel->name);
+
+  for (size_t i = 0; i < UIO_COPY_NR_KERNELS; ++i) {
+    const struct uio_copy_kernel *kernel = &uio_copy_kernels[i];
+    if (!uio_copy_supported(kernel))
+      continue;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kernel->fn(device_mem, host_mem, size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed_sec = gettimediff(&start, &end);
+    printf("[device_mem] (copy_to/%s) elapsed_sec: %.6f / GBps: %.3f\n",
+           kernel->name, elapsed_sec, size / elapsed_sec / 1e9);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kernel->fn(host_mem, device_mem, size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed_sec = gettimediff(&start, &end);
+    printf("[device_mem] (copy_from/%s) elapsed_sec: %.6f / GBps: %.3f\n",
+           kernel->name, elapsed_sec, size / elapsed_sec / 1e9);
+
+    if (memtest(host_mem, size, hex_8b))
+      return EXIT_FAILURE;
+  }
+
   free(host_mem);
   if (munmap(device_mem, size)) {
     perror("munmap");
@@ -0,0 +1,386 @@
+#ifndef UIO_RING_H
+#define UIO_RING_H
+
+/*
+ * Persistent shmem layout and SPSC byte rings
+ *
+ * BAR2 starts with a control block that survives restarts of either side:
+ * tools find the magic and layout version, keep the generation and resume
+ * every ring from its last committed head/tail instead of zeroing them.
+ * The generation changes only when the region is (re)initialized. Each
+ * attach of a producer or a consumer bumps that side's ownership epoch, so
+ * a stale instance can notice that it has been replaced; Epochs only ever
+ * grow, even across a reinitialization.
+ *
+ * Every ring side also has live counters in the statistics area. Only the
+ * owner of a side writes them (relaxed load + store, no locked instruction)
+ * and they never share a cacheline with the other side, so they cost the
+ * data path next to nothing; Monitors map the region read-only and diff
+ * them (see uio_top.c).
+ *
+ *   0                     control block (UIO_CTRL_SIZE)
+ *   UIO_CLOCK_OFFSET      clock synchronization area (see uio_clock.h)
+ *   UIO_BRIDGE_OFFSET     socket bridge connection table (see uio_bridge.c)
+ *   UIO_STATS_OFFSET      per-ring counters
+ *   UIO_RINGS_OFFSET      ring #0 data
+ *   ...                   ring #N data (all rings have the same size and
+ *                         take UIO_RINGS_SIZE at most)
+ *   UIO_SNAPSHOTS_OFFSET  snapshot channels up to the end of BAR2 (see
+ *                         uio_snapshot.h)
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "uio_copy.h"
+
+#define UIO_CTRL_MAGIC 0x4d485356     /* "VSHM" */
+#define UIO_CTRL_INITIALIZING 0x54494e49 /* "INIT" */
+#define UIO_CTRL_RECOVERING 0x56434552   /* "RECV" */
+#define UIO_CTRL_INIT_TIMEOUT_NS 1000000000LL
+#define UIO_CTRL_VERSION 6
+#define UIO_CTRL_SIZE 16384
+#define UIO_CLOCK_OFFSET UIO_CTRL_SIZE
+#define UIO_CLOCK_SIZE 4096
+#define UIO_BRIDGE_OFFSET (UIO_CLOCK_OFFSET + UIO_CLOCK_SIZE)
+#define UIO_BRIDGE_SIZE 4096
+#define UIO_STATS_OFFSET (UIO_BRIDGE_OFFSET + UIO_BRIDGE_SIZE)
+#define UIO_STATS_SIZE 32768
+#define UIO_RINGS_OFFSET (UIO_STATS_OFFSET + UIO_STATS_SIZE)
+#define UIO_RING_MAX 63
+#define UIO_RING_SIZE 131072
+#define UIO_RINGS_SIZE (UIO_RING_MAX * UIO_RING_SIZE)
+#define UIO_SNAPSHOTS_OFFSET (UIO_RINGS_OFFSET + UIO_RINGS_SIZE)
+#define UIO_STATS_BUCKETS 24      /* log2(ns); The last one catches above */
+#define UIO_STATS_NO_OWNER 0xffff
+
+enum uio_ring_side { UIO_RING_PRODUCER, UIO_RING_CONSUMER };
+
+struct uio_ring {
+  _Alignas(64) uint64_t offset; /* From the start of the control block */
+  uint64_t size;                /* Power of two */
+  _Atomic uint64_t epoch[2];    /* Indexed by enum uio_ring_side */
+
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Alignas(64) _Atomic uint64_t closed; /* Stream finished, not detached */
+};
+
+struct uio_ctrl {
+  _Alignas(64) _Atomic uint32_t magic;
+  uint32_t version;
+  _Atomic uint64_t generation;
+  uint32_t nr_rings;
+
+  struct uio_ring ring[UIO_RING_MAX];
+};
+_Static_assert(sizeof(struct uio_ctrl) <= UIO_CTRL_SIZE,
+               "control block does not fit in its area");
+
+/* Counters of one side of a ring; Written only by the owner of that side */
+struct uio_ring_counters {
+  _Alignas(64) _Atomic uint64_t owner; /* IVPosition; UIO_STATS_NO_OWNER */
+  _Atomic uint64_t messages;           /* Writes/reads that moved data */
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t full;      /* Times a write found the ring full */
+  _Atomic uint64_t empty;     /* Times a read found the ring empty */
+  _Atomic uint64_t doorbells; /* Rung for this ring */
+  _Atomic uint64_t wakeups;   /* Interrupts waited for on this ring */
+  _Atomic uint64_t latency[UIO_STATS_BUCKETS]; /* Measured by this side */
+};
+
+struct uio_stats {
+  struct uio_ring_counters ring[UIO_RING_MAX][2]; /* By enum uio_ring_side */
+};
+_Static_assert(sizeof(struct uio_stats) <= UIO_STATS_SIZE,
+               "statistics do not fit in their area");
+
+/* Traffic capture; Set by uio_capture_init() (see uio_capture.h) */
+static void (*uio_ring_hook)(struct uio_ctrl *ctrl, struct uio_ring *ring,
+                             enum uio_ring_side side, const void *buf,
+                             size_t len, size_t head, size_t tail);
+
+/* Total bytes of shared memory used by the layout */
+static inline size_t uio_ctrl_size(unsigned int nr_rings, size_t ring_size) {
+  return UIO_RINGS_OFFSET + nr_rings * ring_size;
+}
+
+/* Whether the layout can serve NR_RINGS rings of RING_SIZE (or has more) */
+static inline int uio_ctrl_match(struct uio_ctrl *ctrl, unsigned int nr_rings,
+                                 size_t ring_size) {
+  return ctrl->version == UIO_CTRL_VERSION && ctrl->nr_rings >= nr_rings &&
+         ctrl->ring[0].size == ring_size;
+}
+
+static inline struct uio_stats *uio_ctrl_stats(struct uio_ctrl *ctrl) {
+  return (struct uio_stats *)((char *)ctrl + UIO_STATS_OFFSET);
+}
+
+static inline void uio_ctrl_init(struct uio_ctrl *ctrl, unsigned int nr_rings,
+                                 size_t ring_size) {
+  struct uio_stats *stats = uio_ctrl_stats(ctrl);
+
+  memset(stats, 0, sizeof(*stats));
+  for (unsigned int i = 0; i < UIO_RING_MAX; ++i) {
+    atomic_store_explicit(&stats->ring[i][UIO_RING_PRODUCER].owner,
+                          UIO_STATS_NO_OWNER, memory_order_relaxed);
+    atomic_store_explicit(&stats->ring[i][UIO_RING_CONSUMER].owner,
+                          UIO_STATS_NO_OWNER, memory_order_relaxed);
+  }
+
+  ctrl->version = UIO_CTRL_VERSION;
+  ctrl->nr_rings = nr_rings;
+  for (unsigned int i = 0; i < UIO_RING_MAX; ++i) {
+    struct uio_ring *ring = &ctrl->ring[i];
+
+    ring->offset = i < nr_rings ? UIO_RINGS_OFFSET + i * ring_size : 0;
+    ring->size = i < nr_rings ? ring_size : 0;
+    /* Epochs are kept: An instance from before must stay replaced. */
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->closed, 0, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&ctrl->generation, 1, memory_order_relaxed);
+}
+
+static inline int64_t uio_ctrl_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Attach to the layout, initializing it only if it is absent or if RESET is
+ * set. A layout with the same ring size and at least NR_RINGS rings is
+ * reused as is; Any other live layout is left alone, since other tools may
+ * be using it, unless RESET replaces it.
+ * An initialization that stays in progress for UIO_CTRL_INIT_TIMEOUT_NS is
+ * taken to have died with its process and is redone; RESET redoes it right
+ * away. Taking over flips the in-progress marker between INITIALIZING and
+ * RECOVERING, so that only one of several waiters wins.
+ * Returns 1 if the region was (re)initialized, 0 if it was reattached in
+ * place, -1 if NR_RINGS or RING_SIZE is invalid, -2 if a live layout does
+ * not match them.
+ */
+static inline int uio_ctrl_attach(struct uio_ctrl *ctrl, unsigned int nr_rings,
+                                  size_t ring_size, int reset) {
+  if (!nr_rings || nr_rings > UIO_RING_MAX || !ring_size ||
+      (ring_size & (ring_size - 1)) || nr_rings * ring_size > UIO_RINGS_SIZE)
+    return -1;
+
+  uint32_t busy_magic = 0;
+  int64_t busy_since = 0;
+
+  for (;;) {
+    uint32_t magic = atomic_load_explicit(&ctrl->magic, memory_order_acquire);
+    int busy = magic == UIO_CTRL_INITIALIZING || magic == UIO_CTRL_RECOVERING;
+
+    /* The other side is initializing it right now, unless it died doing so. */
+    if (busy && !reset) {
+      if (magic != busy_magic) {
+        busy_magic = magic;
+        busy_since = uio_ctrl_now();
+      }
+      if (uio_ctrl_now() - busy_since < UIO_CTRL_INIT_TIMEOUT_NS)
+        continue;
+    }
+    if (magic == UIO_CTRL_MAGIC && !reset)
+      return uio_ctrl_match(ctrl, nr_rings, ring_size) ? 0 : -2;
+
+    uint32_t marker = magic == UIO_CTRL_INITIALIZING ? UIO_CTRL_RECOVERING
+                                                      : UIO_CTRL_INITIALIZING;
+    if (!atomic_compare_exchange_weak_explicit(&ctrl->magic, &magic, marker,
+                                               memory_order_acquire,
+                                               memory_order_relaxed))
+      continue;
+    uio_ctrl_init(ctrl, nr_rings, ring_size);
+    atomic_store_explicit(&ctrl->magic, UIO_CTRL_MAGIC, memory_order_release);
+    return 1;
+  }
+}
+
+static inline uint64_t uio_ctrl_generation(struct uio_ctrl *ctrl) {
+  return atomic_load_explicit(&ctrl->generation, memory_order_relaxed);
+}
+
+static inline void *uio_ring_data(struct uio_ctrl *ctrl,
+                                  struct uio_ring *ring) {
+  return (char *)ctrl + ring->offset;
+}
+
+/* Drop everything in RING; Only for whoever owns both of its sides. */
+static inline void uio_ring_reset(struct uio_ring *ring) {
+  atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring->closed, 0, memory_order_release);
+}
+
+/* Take over one side of RING; Returns the new ownership epoch. */
+static inline uint64_t uio_ring_attach(struct uio_ring *ring,
+                                       enum uio_ring_side side) {
+  return atomic_fetch_add_explicit(&ring->epoch[side], 1,
+                                   memory_order_acq_rel) +
+         1;
+}
+
+static inline int uio_ring_owned(struct uio_ring *ring,
+                                 enum uio_ring_side side, uint64_t epoch) {
+  return atomic_load_explicit(&ring->epoch[side], memory_order_relaxed) ==
+         epoch;
+}
+
+static inline struct uio_ring_counters *
+uio_ring_counters(struct uio_ctrl *ctrl, struct uio_ring *ring,
+                  enum uio_ring_side side) {
+  return &uio_ctrl_stats(ctrl)->ring[ring - ctrl->ring][side];
+}
+
+/* Single writer: Cheaper than atomic_fetch_add() and just as exact */
+static inline void uio_stats_add(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+/* Tell monitors which peer owns SIDE of RING; Right after uio_ring_attach() */
+static inline void uio_ring_set_owner(struct uio_ctrl *ctrl,
+                                      struct uio_ring *ring,
+                                      enum uio_ring_side side,
+                                      uint16_t ivposition) {
+  atomic_store_explicit(&uio_ring_counters(ctrl, ring, side)->owner,
+                        ivposition, memory_order_relaxed);
+}
+
+static inline void uio_ring_count_doorbell(struct uio_ctrl *ctrl,
+                                           struct uio_ring *ring,
+                                           enum uio_ring_side side) {
+  uio_stats_add(&uio_ring_counters(ctrl, ring, side)->doorbells, 1);
+}
+
+static inline void uio_ring_count_wakeup(struct uio_ctrl *ctrl,
+                                         struct uio_ring *ring,
+                                         enum uio_ring_side side) {
+  uio_stats_add(&uio_ring_counters(ctrl, ring, side)->wakeups, 1);
+}
+
+/*
+ * Whether the last write/read of this process on a ring side moved nothing;
+ * Private, so that polling a full or empty ring never touches shmem.
+ */
+static uint8_t uio_ring_starved[UIO_RING_MAX][2];
+
+/* Counts a side running full/empty once, not every poll that finds it so. */
+static inline void uio_ring_count_starved(struct uio_ctrl *ctrl,
+                                          struct uio_ring *ring,
+                                          enum uio_ring_side side,
+                                          int starved) {
+  uint8_t *state = &uio_ring_starved[ring - ctrl->ring][side];
+
+  if (starved && !*state) {
+    struct uio_ring_counters *counters = uio_ring_counters(ctrl, ring, side);
+    uio_stats_add(side == UIO_RING_PRODUCER ? &counters->full
+                                            : &counters->empty,
+                  1);
+  }
+  *state = starved;
+}
+
+static inline int uio_stats_bucket(uint64_t ns) {
+  int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  return bucket < UIO_STATS_BUCKETS ? bucket : UIO_STATS_BUCKETS - 1;
+}
+
+static inline void uio_ring_count_latency(struct uio_ctrl *ctrl,
+                                          struct uio_ring *ring,
+                                          enum uio_ring_side side,
+                                          int64_t latency_ns) {
+  if (latency_ns >= 0)
+    uio_stats_add(&uio_ring_counters(ctrl, ring, side)
+                       ->latency[uio_stats_bucket(latency_ns)],
+                  1);
+}
+
+static inline size_t uio_ring_used(struct uio_ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  return (head + ring->size - tail) & (ring->size - 1);
+}
+
+static inline size_t uio_ring_free(struct uio_ring *ring) {
+  return ring->size - 1 - uio_ring_used(ring);
+}
+
+/* Copies up to LEN bytes from BUF into RING; Returns the bytes committed. */
+static inline size_t uio_ring_write(struct uio_ctrl *ctrl,
+                                    struct uio_ring *ring, const void *buf,
+                                    size_t len) {
+  size_t size = ring->size, mask = size - 1;
+  void *real_buf = uio_ring_data(ctrl, ring);
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  size_t free_space = (tail + size - head - 1) & mask;
+
+  size_t to_write = (len < free_space ? len : free_space);
+  size_t first_part = to_write < (size - head) ? to_write : (size - head);
+
+  uio_copy.to_shmem(real_buf + head, buf, first_part);
+  uio_copy.to_shmem(real_buf, buf + first_part, to_write - first_part);
+
+  atomic_store_explicit(&ring->head, (head + to_write) & mask,
+                        memory_order_release);
+
+  if (to_write) {
+    struct uio_ring_counters *counters =
+        uio_ring_counters(ctrl, ring, UIO_RING_PRODUCER);
+    uio_stats_add(&counters->messages, 1);
+    uio_stats_add(&counters->bytes, to_write);
+    if (__builtin_expect(uio_ring_hook != NULL, 0))
+      uio_ring_hook(ctrl, ring, UIO_RING_PRODUCER, buf, to_write,
+                    (head + to_write) & mask, tail);
+  }
+  if (len)
+    uio_ring_count_starved(ctrl, ring, UIO_RING_PRODUCER, !to_write);
+  return to_write;
+}
+
+/* Copies up to LEN bytes from RING into BUF; Returns the bytes consumed. */
+static inline size_t uio_ring_read(struct uio_ctrl *ctrl, struct uio_ring *ring,
+                                   void *buf, size_t len) {
+  size_t size = ring->size, mask = size - 1;
+  void *real_buf = uio_ring_data(ctrl, ring);
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  size_t avail = (head + size - tail) & mask;
+
+  size_t to_read = (len < avail ? len : avail);
+  size_t first_part = to_read < (size - tail) ? to_read : (size - tail);
+
+  uio_copy.from_shmem(buf, real_buf + tail, first_part);
+  uio_copy.from_shmem(buf + first_part, real_buf, to_read - first_part);
+
+  atomic_store_explicit(&ring->tail, (tail + to_read) & mask,
+                        memory_order_release);
+
+  if (to_read) {
+    struct uio_ring_counters *counters =
+        uio_ring_counters(ctrl, ring, UIO_RING_CONSUMER);
+    uio_stats_add(&counters->messages, 1);
+    uio_stats_add(&counters->bytes, to_read);
+    if (__builtin_expect(uio_ring_hook != NULL, 0))
+      uio_ring_hook(ctrl, ring, UIO_RING_CONSUMER, buf, to_read, head,
+                    (tail + to_read) & mask);
+  }
+  if (len)
+    uio_ring_count_starved(ctrl, ring, UIO_RING_CONSUMER, !to_read);
+  return to_read;
+}
+
+#endif /* UIO_RING_H */
@@ -0,0 +1,243 @@
+#ifndef UIO_SNAPSHOT_H
+#define UIO_SNAPSHOT_H
+
+/*
+ * Seqlock snapshot channel ("latest value wins")
+ *
+ * A single writer publishes whole structures into one of NR_SLOTS buffers
+ * (double or triple buffering) and bumps the channel sequence. Readers pick
+ * the slot of the latest sequence and validate it against the per-slot
+ * sequence, retrying only if the writer lapped them. The writer never waits
+ * for readers.
+ *
+ * Publish #n (n >= 1) goes to slot (n - 1) % nr_slots, whose sequence is
+ * odd (2n - 1) while being written and even (2n) once complete.
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "uio_copy.h"
+#include "uio_ivshmem.h"
+
+#define UIO_SNAPSHOT_MAGIC 0x50414e53 /* "SNAP" */
+#define UIO_SNAPSHOT_MAX_SLOTS 3
+#define UIO_SNAPSHOT_MAX_PEERS 64
+#define UIO_SNAPSHOT_HDR_SIZE 4096
+#define UIO_SNAPSHOT_ALIGN 64
+
+struct uio_snapshot {
+  _Alignas(64) _Atomic uint32_t magic;
+  uint32_t nr_slots;
+  uint64_t slot_size;
+
+  _Alignas(64) _Atomic uint64_t seq;
+
+  /* Bit N is set while the peer with IVPosition N sleeps on its doorbell */
+  _Alignas(64) _Atomic uint64_t waiters;
+
+  struct {
+    _Alignas(64) _Atomic uint64_t seq;
+    uint64_t len;
+  } slot[UIO_SNAPSHOT_MAX_SLOTS];
+};
+_Static_assert(sizeof(struct uio_snapshot) <= UIO_SNAPSHOT_HDR_SIZE,
+               "snapshot header does not fit in its page");
+
+struct uio_snapshot_view {
+  const void *data;
+  size_t len;
+  uint64_t seq;
+  unsigned int idx;
+};
+
+static inline size_t uio_snapshot_slot_stride(size_t slot_size) {
+  return (slot_size + UIO_SNAPSHOT_ALIGN - 1) &
+         ~(size_t)(UIO_SNAPSHOT_ALIGN - 1);
+}
+
+/* Total bytes of shared memory used by a channel */
+static inline size_t uio_snapshot_size(unsigned int nr_slots,
+                                       size_t slot_size) {
+  return UIO_SNAPSHOT_HDR_SIZE + nr_slots * uio_snapshot_slot_stride(slot_size);
+}
+
+static inline void *uio_snapshot_slot(struct uio_snapshot *snap,
+                                      unsigned int idx) {
+  return (char *)snap + UIO_SNAPSHOT_HDR_SIZE +
+         idx * uio_snapshot_slot_stride(snap->slot_size);
+}
+
+/* Returns 0 if SNAP already holds a channel with the given geometry. */
+static inline int uio_snapshot_check(struct uio_snapshot *snap,
+                                     unsigned int nr_slots, size_t slot_size) {
+  if (atomic_load_explicit(&snap->magic, memory_order_acquire) !=
+      UIO_SNAPSHOT_MAGIC)
+    return -1;
+  if (snap->nr_slots != nr_slots || snap->slot_size != slot_size)
+    return -1;
+  return 0;
+}
+
+/*
+ * Reader side: validate the channel at SNAP, whose mapping holds AREA_SIZE
+ * bytes, before trusting its geometry. Returns -1 if there is no channel,
+ * -2 if its geometry is out of range or overruns the mapping.
+ */
+static inline int uio_snapshot_attach(struct uio_snapshot *snap,
+                                      size_t area_size) {
+  if (atomic_load_explicit(&snap->magic, memory_order_acquire) !=
+      UIO_SNAPSHOT_MAGIC)
+    return -1;
+  if (snap->nr_slots < 2 || snap->nr_slots > UIO_SNAPSHOT_MAX_SLOTS ||
+      !snap->slot_size || snap->slot_size > area_size ||
+      uio_snapshot_size(snap->nr_slots, snap->slot_size) > area_size)
+    return -2;
+  return 0;
+}
+
+static inline int uio_snapshot_init(struct uio_snapshot *snap,
+                                    unsigned int nr_slots, size_t slot_size) {
+  if (nr_slots < 2 || nr_slots > UIO_SNAPSHOT_MAX_SLOTS || !slot_size)
+    return -1;
+
+  atomic_store_explicit(&snap->magic, 0, memory_order_relaxed);
+  snap->nr_slots = nr_slots;
+  snap->slot_size = slot_size;
+  atomic_store_explicit(&snap->seq, 0, memory_order_relaxed);
+  atomic_store_explicit(&snap->waiters, 0, memory_order_relaxed);
+  for (unsigned int i = 0; i < UIO_SNAPSHOT_MAX_SLOTS; ++i) {
+    atomic_store_explicit(&snap->slot[i].seq, 0, memory_order_relaxed);
+    snap->slot[i].len = 0;
+  }
+  atomic_store_explicit(&snap->magic, UIO_SNAPSHOT_MAGIC, memory_order_release);
+  return 0;
+}
+
+/*
+ * Writer side: reserve the next slot, fill up to slot_size bytes of it in
+ * place and publish it with uio_snapshot_commit().
+ */
+static inline void *uio_snapshot_begin(struct uio_snapshot *snap) {
+  uint64_t next = atomic_load_explicit(&snap->seq, memory_order_relaxed) + 1;
+  unsigned int idx = (next - 1) % snap->nr_slots;
+
+  atomic_store_explicit(&snap->slot[idx].seq, 2 * next - 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  return uio_snapshot_slot(snap, idx);
+}
+
+/* Returns the bitmask of waiting peers that should get a doorbell. */
+static inline uint64_t uio_snapshot_commit(struct uio_snapshot *snap,
+                                           size_t len) {
+  uint64_t next = atomic_load_explicit(&snap->seq, memory_order_relaxed) + 1;
+  unsigned int idx = (next - 1) % snap->nr_slots;
+
+  snap->slot[idx].len = len;
+  atomic_store_explicit(&snap->slot[idx].seq, 2 * next, memory_order_release);
+  atomic_store_explicit(&snap->seq, next, memory_order_seq_cst);
+
+  /* Cheap check first, so nobody pays for the RMW without waiters */
+  if (!atomic_load_explicit(&snap->waiters, memory_order_seq_cst))
+    return 0;
+  return atomic_exchange_explicit(&snap->waiters, 0, memory_order_seq_cst);
+}
+
+static inline uint64_t uio_snapshot_publish(struct uio_snapshot *snap,
+                                            const void *buf, size_t len) {
+  if (len > snap->slot_size)
+    len = snap->slot_size;
+  uio_copy.to_shmem(uio_snapshot_begin(snap), buf, len);
+  return uio_snapshot_commit(snap, len);
+}
+
+static inline void uio_snapshot_notify(struct ivshmem_reg *reg_ptr,
+                                       uint64_t waiters, uint16_t msi_index) {
+  while (waiters) {
+    int peer = __builtin_ctzll(waiters);
+    waiters &= waiters - 1;
+    ivshmem_doorbell(reg_ptr, peer, msi_index);
+  }
+}
+
+static inline uint64_t uio_snapshot_seq(struct uio_snapshot *snap) {
+  return atomic_load_explicit(&snap->seq, memory_order_acquire);
+}
+
+/*
+ * Reader side, zero-copy: VIEW points straight into the slot and must be
+ * validated with uio_snapshot_view_valid() after the data has been consumed.
+ * Returns -1 if nothing has been published yet.
+ */
+static inline int uio_snapshot_view_begin(struct uio_snapshot *snap,
+                                          struct uio_snapshot_view *view) {
+  for (;;) {
+    uint64_t seq = atomic_load_explicit(&snap->seq, memory_order_acquire);
+    if (!seq)
+      return -1;
+
+    unsigned int idx = (seq - 1) % snap->nr_slots;
+    if (atomic_load_explicit(&snap->slot[idx].seq, memory_order_acquire) !=
+        2 * seq)
+      continue; /* Lapped by the writer; Retry with the newer one. */
+
+    view->data = uio_snapshot_slot(snap, idx);
+    view->len = snap->slot[idx].len < snap->slot_size ? snap->slot[idx].len
+                                                      : snap->slot_size;
+    view->seq = seq;
+    view->idx = idx;
+    return 0;
+  }
+}
+
+static inline int
+uio_snapshot_view_valid(struct uio_snapshot *snap,
+                        const struct uio_snapshot_view *view) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&snap->slot[view->idx].seq,
+                              memory_order_relaxed) == 2 * view->seq;
+}
+
+/*
+ * Reader side, copying: returns the snapshot length (truncated to SIZE) and
+ * its sequence in SEQ_PTR, or -1 if nothing has been published yet.
+ */
+static inline long uio_snapshot_read(struct uio_snapshot *snap, void *buf,
+                                     size_t size, uint64_t *seq_ptr) {
+  struct uio_snapshot_view view;
+  size_t len;
+
+  do {
+    if (uio_snapshot_view_begin(snap, &view))
+      return -1;
+    len = view.len < size ? view.len : size;
+    uio_copy.from_shmem(buf, view.data, len);
+  } while (!uio_snapshot_view_valid(snap, &view));
+
+  if (seq_ptr)
+    *seq_ptr = view.seq;
+  return len;
+}
+
+/*
+ * Subscriber side: announce that we are about to sleep on the doorbell.
+ * Returns 1 if a snapshot newer than LAST_SEQ showed up meanwhile (do not
+ * sleep), 0 otherwise.
+ */
+static inline int uio_snapshot_wait_prepare(struct uio_snapshot *snap,
+                                            uint16_t ivposition,
+                                            uint64_t last_seq) {
+  uint64_t bit = 1ULL << (ivposition % UIO_SNAPSHOT_MAX_PEERS);
+
+  atomic_fetch_or_explicit(&snap->waiters, bit, memory_order_seq_cst);
+  if (atomic_load_explicit(&snap->seq, memory_order_seq_cst) != last_seq) {
+    atomic_fetch_and_explicit(&snap->waiters, ~bit, memory_order_relaxed);
+    return 1;
+  }
+  return 0;
+}
+
+#endif /* UIO_SNAPSHOT_H */
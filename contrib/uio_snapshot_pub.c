@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "uio_ring.h"
+#include "uio_snapshot.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 7) {
+    fprintf(stderr, "Usage: %s FILE OFFSET SIZE NR_SLOTS COUNT SLEEP_US\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *filename = argv[1];
+  size_t offset = strtoul(argv[2], NULL, 10);
+  size_t slot_size = strtoul(argv[3], NULL, 10);
+  unsigned int nr_slots = strtoul(argv[4], NULL, 10);
+  size_t count = strtoul(argv[5], NULL, 10);
+  __useconds_t sleep_us = atoi(argv[6]);
+
+  /* OFFSET is relative to the snapshot area of the layout. */
+  if (offset % UIO_SNAPSHOT_HDR_SIZE) {
+    fprintf(stderr, "OFFSET must be a multiple of %d\n",
+            UIO_SNAPSHOT_HDR_SIZE);
+    exit(EXIT_FAILURE);
+  }
+  slot_size &= ~(sizeof(uint64_t) - 1);
+  if (!slot_size) {
+    fprintf(stderr, "SIZE must be at least %lu\n", sizeof(uint64_t));
+    exit(EXIT_FAILURE);
+  }
+  size_t device_size = ivshmem_bar2_size(filename);
+  if (device_size <= UIO_SNAPSHOTS_OFFSET) {
+    fprintf(stderr, "%s leaves no room for snapshots past %d bytes\n",
+            filename, UIO_SNAPSHOTS_OFFSET);
+    exit(EXIT_FAILURE);
+  }
+  size_t area_size = device_size - UIO_SNAPSHOTS_OFFSET;
+  size_t snap_size = uio_snapshot_size(nr_slots, slot_size);
+  if (offset + snap_size > area_size) {
+    fprintf(stderr, "The channel does not fit in the %lu bytes at OFFSET\n",
+            area_size);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "[UIO] Opening file %s...", filename);
+  int fd = open(filename, O_RDWR);
+  if (fd == -1) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Mapping the file...");
+  size_t pagesize = getpagesize();
+  struct ivshmem_reg *reg_ptr =
+      mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (reg_ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  /* The uio core only maps whole regions, so map BAR2 from its start. */
+  void *device_mem = mmap(NULL, device_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  struct uio_snapshot *snap = device_mem + UIO_SNAPSHOTS_OFFSET + offset;
+  fprintf(stderr, " Done!\n\n");
+
+  uio_copy_init(uio_memtype_detect(filename));
+  fprintf(stderr, "[UIO] Copy kernels: %s / %s\n\n", uio_copy.to_kernel->name,
+          uio_copy.from_kernel->name);
+
+  if (uio_snapshot_check(snap, nr_slots, slot_size)) {
+    fprintf(stderr, "[UIO] Initializing the channel...");
+    if (uio_snapshot_init(snap, nr_slots, slot_size)) {
+      fprintf(stderr, " Invalid NR_SLOTS (2 ~ %d)\n", UIO_SNAPSHOT_MAX_SLOTS);
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, " Done!\n\n");
+  } else
+    fprintf(stderr, "[UIO] Resuming the channel at seq %lu\n\n",
+            uio_snapshot_seq(snap));
+
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t seq = uio_snapshot_seq(snap) + 1;
+
+    /* Every word carries the sequence so that readers can spot tearing. */
+    uint64_t *data = uio_snapshot_begin(snap);
+    for (size_t j = 0; j < slot_size / sizeof(uint64_t); ++j)
+      data[j] = seq;
+    uint64_t waiters = uio_snapshot_commit(snap, slot_size);
+
+    uio_snapshot_notify(reg_ptr, waiters, DEFAULT_MSIX_INDEX);
+    fprintf(stderr, "[UIO] Published #%lu (waiters: 0x%lx)\n", seq, waiters);
+
+    if (sleep_us)
+      usleep(sleep_us);
+  }
+  fprintf(stderr, "\n");
+
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, device_size) || munmap(reg_ptr, pagesize)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Closing the file...");
+  if (close(fd)) {
+    perror("close");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Exiting...\n\n");
+
+  return EXIT_SUCCESS;
+}
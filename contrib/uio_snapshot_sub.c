@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include "uio_ring.h"
+#include "uio_snapshot.h"
+
+static int check_words(const uint64_t *data, size_t len, uint64_t seq) {
+  for (size_t i = 0; i < len / sizeof(uint64_t); ++i)
+    if (data[i] != seq)
+      return -1;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 5) {
+    fprintf(stderr, "Usage: %s FILE OFFSET COUNT ZEROCOPY\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *filename = argv[1];
+  size_t offset = strtoul(argv[2], NULL, 10);
+  size_t count = strtoul(argv[3], NULL, 10);
+  int zerocopy = atoi(argv[4]);
+
+  /* OFFSET is relative to the snapshot area of the layout. */
+  size_t device_size = ivshmem_bar2_size(filename);
+  size_t area_size = device_size > UIO_SNAPSHOTS_OFFSET
+                         ? device_size - UIO_SNAPSHOTS_OFFSET
+                         : 0;
+  if (offset % UIO_SNAPSHOT_HDR_SIZE ||
+      offset + UIO_SNAPSHOT_HDR_SIZE > area_size) {
+    fprintf(stderr, "OFFSET must be a multiple of %d below %lu\n",
+            UIO_SNAPSHOT_HDR_SIZE, area_size);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "[UIO] Opening file %s...", filename);
+  int fd = open(filename, O_RDWR | O_NONBLOCK);
+  if (fd == -1) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Setting up Epoll %s...", filename);
+  int epfd = epoll_create1(0);
+  if (epfd == -1) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Mapping the file...");
+  size_t pagesize = getpagesize();
+  struct ivshmem_reg *reg_ptr =
+      mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (reg_ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  uint16_t ivposition = reg_ptr->ivposition;
+
+  /* The uio core only maps whole regions, so map BAR2 from its start. */
+  void *device_mem = mmap(NULL, device_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  struct uio_snapshot *snap = device_mem + UIO_SNAPSHOTS_OFFSET + offset;
+  int ret = uio_snapshot_attach(snap, area_size - offset);
+  if (ret) {
+    fprintf(stderr, ret == -1 ? " No channel at offset %lu\n"
+                              : " The channel at offset %lu is corrupted\n",
+            offset);
+    exit(EXIT_FAILURE);
+  }
+  size_t slot_size = snap->slot_size;
+  fprintf(stderr, " Done!\n\n");
+
+  uio_copy_init(uio_memtype_detect(filename));
+  fprintf(stderr, "[UIO] Copy kernels: %s / %s\n\n", uio_copy.to_kernel->name,
+          uio_copy.from_kernel->name);
+
+  uint64_t *mybuf = malloc(slot_size);
+  if (!mybuf) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t last_seq = 0;
+  for (size_t i = 0; i < count; ++i) {
+    while (uio_snapshot_seq(snap) == last_seq) {
+      if (uio_snapshot_wait_prepare(snap, ivposition, last_seq))
+        break;
+      if (epoll_wait(epfd, &ev, 1, -1) != 1) {
+        perror("epoll_wait");
+        exit(EXIT_FAILURE);
+      }
+      uint32_t value;
+      if (read(ev.data.fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("read");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    uint64_t seq = 0;
+    int torn = 1;
+    if (zerocopy) {
+      struct uio_snapshot_view view;
+      while (!uio_snapshot_view_begin(snap, &view)) {
+        torn = check_words(view.data, view.len, view.seq);
+        seq = view.seq;
+        if (uio_snapshot_view_valid(snap, &view))
+          break;
+      }
+    } else {
+      long len = uio_snapshot_read(snap, mybuf, slot_size, &seq);
+      torn = len < 0 || check_words(mybuf, len, seq);
+    }
+
+    printf("[UIO] Received #%lu (skipped: %lu)%s\n", seq, seq - last_seq - 1,
+           torn ? " TORN!" : "");
+    if (torn)
+      exit(EXIT_FAILURE);
+    last_seq = seq;
+  }
+  fprintf(stderr, "\n");
+
+  free(mybuf);
+
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, device_size) || munmap(reg_ptr, pagesize)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Closing the file...");
+  if (close(fd)) {
+    perror("close");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Exiting...\n\n");
+
+  return EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#include <signal.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,21 +10,21 @@
 
 #include <sys/mman.h>
 
-struct ivshmem_reg {
-  volatile uint32_t intrmask;
-  volatile uint32_t intrstatus;
-  volatile uint32_t ivposition;
-  volatile uint32_t doorbell;
-  volatile uint32_t ivlivelist;
-};
+#include "uio_capture.h"
+#include "uio_ivshmem.h"
+#include "uio_ring.h"
+
+volatile sig_atomic_t should_exit = 0;
+void sigterm_handler(int signum) { should_exit = 1; }
 
 int main(int argc, char **argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s FILE DEST_IVPOSITION\n", argv[0]);
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s FILE DEST_IVPOSITION [RESET]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
   const char *filename = argv[1];
   int16_t dest_ivposition = atoi(argv[2]);
+  int reset = argc == 4 && atoi(argv[3]);
 
   fprintf(stderr, "[UIO] Opening file %s...", filename);
   int fd = open(filename, O_RDWR);
@@ -43,54 +44,76 @@ int main(int argc, char **argv) {
   }
   fprintf(stderr, " Done!\n\n");
 
-#define RING_SIZE 131072
-#define RING_MASK (RING_SIZE - 1)
-#define PAGE_SIZE 4096
-
-  void *device_mem = mmap(NULL, PAGE_SIZE + RING_SIZE, PROT_READ | PROT_WRITE,
-                          MAP_SHARED, fd, PAGE_SIZE);
+  size_t device_size = uio_ctrl_size(1, UIO_RING_SIZE);
+  void *device_mem = mmap(NULL, device_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
   if (device_mem == MAP_FAILED) {
     perror("mmap");
     return EXIT_FAILURE;
   }
 
-  struct {
-    atomic_size_t head;
-    atomic_size_t tail;
-    atomic_size_t closed;
-  } *ring_ptr = device_mem;
-  atomic_store_explicit(&ring_ptr->head, 0, memory_order_relaxed);
-  atomic_store_explicit(&ring_ptr->tail, 0, memory_order_relaxed);
+  uio_copy_init(uio_memtype_detect(filename));
+  fprintf(stderr, "[UIO] Copy kernels: %s / %s\n\n", uio_copy.to_kernel->name,
+          uio_copy.from_kernel->name);
+
+  struct uio_ctrl *ctrl = device_mem;
+  int fresh = uio_ctrl_attach(ctrl, 1, UIO_RING_SIZE, reset);
+  if (fresh < 0) {
+    fprintf(stderr, "%s holds another live layout; Pass RESET to replace it\n",
+            filename);
+    exit(EXIT_FAILURE);
+  }
+  if (fresh)
+    fprintf(stderr, "[UIO] Initialized the region (generation: %lu)\n\n",
+            uio_ctrl_generation(ctrl));
+  else
+    fprintf(stderr, "[UIO] Reattached to the region (generation: %lu)\n\n",
+            uio_ctrl_generation(ctrl));
+
+  struct uio_ring *ring_ptr = &ctrl->ring[0];
+  uint64_t epoch = uio_ring_attach(ring_ptr, UIO_RING_PRODUCER);
+  uio_ring_set_owner(ctrl, ring_ptr, UIO_RING_PRODUCER, reg_ptr->ivposition);
+
+  int capturing = uio_capture_init(ctrl, reg_ptr->ivposition);
+  if (capturing < 0) {
+    perror("uio_capture_init");
+    exit(EXIT_FAILURE);
+  }
+  if (capturing)
+    fprintf(stderr, "[UIO] Capturing to %s\n\n", getenv("UIO_CAPTURE"));
+
+  /* Leave the loop below, so that the capture is flushed on the way out. */
+  signal(SIGINT, sigterm_handler);
+  signal(SIGTERM, sigterm_handler);
   atomic_store_explicit(&ring_ptr->closed, 0, memory_order_relaxed);
-  void *real_buf = device_mem + PAGE_SIZE;
 
-  char mybuf[RING_SIZE];
+  char mybuf[UIO_RING_SIZE];
 
-#define DEFAULT_MSIX_INDEX 0
-  uint32_t msg = (uint32_t)dest_ivposition << 16 | DEFAULT_MSIX_INDEX;
   fprintf(stderr, "[UIO] Writing the interrupt...");
-  reg_ptr->doorbell = msg;
+  ivshmem_doorbell(reg_ptr, dest_ivposition, DEFAULT_MSIX_INDEX);
+  uio_ring_count_doorbell(ctrl, ring_ptr, UIO_RING_PRODUCER);
   fprintf(stderr, " Done!\n\n");
 
-  while (!ring_ptr->closed) {
-    size_t head = atomic_load_explicit(&ring_ptr->head, memory_order_relaxed);
-    size_t tail = atomic_load_explicit(&ring_ptr->tail, memory_order_acquire);
-
-    size_t free_space = (tail + RING_SIZE - head - 1) & RING_MASK;
-
-    size_t to_write = (RING_SIZE < free_space ? RING_SIZE : free_space);
-    size_t first_part =
-        to_write < (RING_SIZE - head) ? to_write : (RING_SIZE - head);
-
-    memcpy(real_buf + head, mybuf, first_part);
-    memcpy(real_buf, mybuf + first_part, to_write - first_part);
-
-    atomic_store_explicit(&ring_ptr->head, (head + to_write) & RING_MASK,
-                          memory_order_release);
+  while (!should_exit &&
+         !atomic_load_explicit(&ring_ptr->closed, memory_order_relaxed) &&
+         uio_ring_owned(ring_ptr, UIO_RING_PRODUCER, epoch))
+    uio_ring_write(ctrl, ring_ptr, mybuf, sizeof(mybuf));
+
+  if (!uio_ring_owned(ring_ptr, UIO_RING_PRODUCER, epoch))
+    fprintf(stderr, "[UIO] Taken over by another producer\n\n");
+
+  if (capturing) {
+    fprintf(stderr, "[UIO] Flushing the capture...");
+    if (uio_capture_stop()) {
+      perror("uio_capture_stop");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, " Done! (records: %lu / dropped: %lu)\n\n",
+            uio_capture.records, uio_capture.dropped);
   }
 
   fprintf(stderr, "[UIO] Unmapping the file...");
-  if (munmap(reg_ptr, pagesize)) {
+  if (munmap(device_mem, device_size) || munmap(reg_ptr, pagesize)) {
     perror("munmap");
     exit(EXIT_FAILURE);
   }
@@ -11,15 +11,26 @@
 #include <sys/epoll.h>
 #include <sys/mman.h>
 
-int should_exit = 0;
-void sigalrm_handler(int signum) { should_exit = 1; }
+#include "uio_capture.h"
+#include "uio_ivshmem.h"
+#include "uio_ring.h"
+
+/*
+ * SIGALRM ends the stream: The producer is told to stop. SIGINT/SIGTERM only
+ * detach this consumer, so that a restarted server resumes the stream.
+ */
+enum { RUNNING, FINISHED, DETACHED };
+volatile sig_atomic_t should_exit = RUNNING;
+void sigalrm_handler(int signum) { should_exit = FINISHED; }
+void sigterm_handler(int signum) { should_exit = DETACHED; }
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s FILE [RESET]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
   const char *filename = argv[1];
+  int reset = argc == 3 && atoi(argv[2]);
 
   fprintf(stderr, "[UIO] Opening file %s...", filename);
   int fd = open(filename, O_RDWR);
@@ -55,69 +66,110 @@ int main(int argc, char *argv[]) {
   }
   fprintf(stderr, " Done!\n\n");
 
-  fprintf(stderr, "[UIO] Reading the interrupt...");
-  if (epoll_wait(epfd, &ev, 1, -1) != 1) {
-    perror("epoll_wait");
-    exit(EXIT_FAILURE);
+  size_t pagesize = getpagesize();
+  struct ivshmem_reg *reg_ptr =
+      mmap(NULL, pagesize, PROT_READ, MAP_SHARED, fd, 0);
+  if (reg_ptr == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
   }
-  int target_fd = ev.data.fd;
-  uint32_t value;
-  if (read(target_fd, &value, sizeof(value)) != sizeof(value)) {
-    perror("read");
-    exit(EXIT_FAILURE);
+  size_t device_size = uio_ctrl_size(1, UIO_RING_SIZE);
+  void *device_mem = mmap(NULL, device_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
   }
-  fprintf(stderr, " Done!\n\n");
 
-  fprintf(stderr, "[UIO] Starting the test... ");
+  uio_copy_init(uio_memtype_detect(filename));
+  fprintf(stderr, "[UIO] Copy kernels: %s / %s\n\n", uio_copy.to_kernel->name,
+          uio_copy.from_kernel->name);
 
-#define RING_SIZE 131072
-#define RING_MASK (RING_SIZE - 1)
-#define PAGE_SIZE 4096
+  struct uio_ctrl *ctrl = device_mem;
+  int fresh = uio_ctrl_attach(ctrl, 1, UIO_RING_SIZE, reset);
+  if (fresh < 0) {
+    fprintf(stderr, "%s holds another live layout; Pass RESET to replace it\n",
+            filename);
+    exit(EXIT_FAILURE);
+  }
+  struct uio_ring *ring_ptr = &ctrl->ring[0];
+  uint64_t epoch = uio_ring_attach(ring_ptr, UIO_RING_CONSUMER);
+  uio_ring_set_owner(ctrl, ring_ptr, UIO_RING_CONSUMER, reg_ptr->ivposition);
 
-  void *device_mem = mmap(NULL, PAGE_SIZE + RING_SIZE, PROT_READ | PROT_WRITE,
-                          MAP_SHARED, fd, PAGE_SIZE);
-  if (device_mem == MAP_FAILED) {
-    perror("mmap");
-    return EXIT_FAILURE;
+  int capturing = uio_capture_init(ctrl, reg_ptr->ivposition);
+  if (capturing < 0) {
+    perror("uio_capture_init");
+    exit(EXIT_FAILURE);
   }
+  if (capturing)
+    fprintf(stderr, "[UIO] Capturing to %s\n\n", getenv("UIO_CAPTURE"));
+
+  /* A producer that is already streaming will not ring the doorbell again. */
+  if (fresh || atomic_load_explicit(&ring_ptr->closed, memory_order_relaxed)) {
+    fprintf(stderr, "[UIO] Reading the interrupt...");
+    if (epoll_wait(epfd, &ev, 1, -1) != 1) {
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    int target_fd = ev.data.fd;
+    uint32_t value;
+    if (read(target_fd, &value, sizeof(value)) != sizeof(value)) {
+      perror("read");
+      exit(EXIT_FAILURE);
+    }
+    uio_ring_count_wakeup(ctrl, ring_ptr, UIO_RING_CONSUMER);
+    fprintf(stderr, " Done!\n\n");
+  } else
+    fprintf(stderr,
+            "[UIO] Reattached to the region (generation: %lu / pending: "
+            "%lu)\n\n",
+            uio_ctrl_generation(ctrl), uio_ring_used(ring_ptr));
 
-  struct {
-    atomic_size_t head;
-    atomic_size_t tail;
-    atomic_size_t closed;
-  } *ring_ptr = device_mem;
-  void *real_buf = device_mem + PAGE_SIZE;
+  fprintf(stderr, "[UIO] Starting the test... ");
 
   signal(SIGALRM, sigalrm_handler);
+  signal(SIGINT, sigterm_handler);
+  signal(SIGTERM, sigterm_handler);
   alarm(10);
 
-  char mybuf[RING_SIZE];
+  char mybuf[UIO_RING_SIZE];
 
   unsigned long long total_read_count = 0;
-  while (!should_exit) {
-    size_t head = atomic_load_explicit(&ring_ptr->head, memory_order_acquire);
-    size_t tail = atomic_load_explicit(&ring_ptr->tail, memory_order_relaxed);
-
-    size_t avail = (head + RING_SIZE - tail) & RING_MASK;
+  while (!should_exit && uio_ring_owned(ring_ptr, UIO_RING_CONSUMER, epoch))
+    total_read_count += uio_ring_read(ctrl, ring_ptr, mybuf, sizeof(mybuf));
 
-    size_t to_read = (RING_SIZE < avail ? RING_SIZE : avail);
-    size_t first_part =
-        to_read < (RING_SIZE - tail) ? to_read : (RING_SIZE - tail);
+  if (!uio_ring_owned(ring_ptr, UIO_RING_CONSUMER, epoch)) {
+    fprintf(stderr, " Taken over by another consumer\n\n");
+    if (capturing && uio_capture_stop())
+      perror("uio_capture_stop");
+    exit(EXIT_FAILURE);
+  }
 
-    memcpy(mybuf, real_buf + tail, first_part);
-    memcpy(mybuf + first_part, real_buf, to_read - first_part);
+  if (should_exit == FINISHED) {
+    atomic_store_explicit(&ring_ptr->closed, 1, memory_order_relaxed);
+    fprintf(stderr, " Done!\n\n");
+  } else
+    fprintf(stderr, " Detached (pending: %lu)\n\n", uio_ring_used(ring_ptr));
 
-    atomic_store_explicit(&ring_ptr->tail, (tail + to_read) & RING_MASK,
-                          memory_order_release);
+  fprintf(stderr, "[UIO] total_read_count: %llu\n\n", total_read_count);
 
-    total_read_count += to_read;
+  if (capturing) {
+    fprintf(stderr, "[UIO] Flushing the capture...");
+    if (uio_capture_stop()) {
+      perror("uio_capture_stop");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, " Done! (records: %lu / dropped: %lu)\n\n",
+            uio_capture.records, uio_capture.dropped);
   }
 
-  atomic_store_explicit(&ring_ptr->closed, 1, memory_order_relaxed);
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, device_size) || munmap(reg_ptr, pagesize)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
   fprintf(stderr, " Done!\n\n");
 
-  fprintf(stderr, "[UIO] total_read_count: %llu\n\n", total_read_count);
-
   fprintf(stderr, "[UIO] Closing the file... ");
   if (close(fd)) {
     perror("close");
@@ -0,0 +1,225 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "uio_ring.h"
+
+/*
+ * Live view of the ring counters (see uio_ring.h)
+ *
+ * The region is opened and mapped read-only, so watching costs the data path
+ * nothing beyond the counters it keeps anyway. Rates are per second over the
+ * last INTERVAL_MS; Latency percentiles are the upper bounds of the log2
+ * buckets filled during the interval.
+ */
+
+#define MAX_PEERS 65536
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void snapshot(struct uio_stats *dst, const struct uio_stats *src) {
+  const _Atomic uint64_t *from = (const _Atomic uint64_t *)src;
+  uint64_t *to = (uint64_t *)dst;
+
+  for (size_t i = 0; i < sizeof(*src) / sizeof(uint64_t); ++i)
+    to[i] = atomic_load_explicit(&from[i], memory_order_relaxed);
+}
+
+#define DELTA(field) (cur->field - prev->field)
+
+/* Upper bound of the bucket holding the PERCENT-th percentile */
+static const char *percentile(const struct uio_ring_counters *cur,
+                              const struct uio_ring_counters *prev,
+                              unsigned int percent, char *buf, size_t len) {
+  uint64_t total = 0, seen = 0;
+
+  for (int i = 0; i < UIO_STATS_BUCKETS; ++i)
+    total += DELTA(latency[i]);
+  if (!total)
+    return "-";
+  for (int i = 0; i < UIO_STATS_BUCKETS; ++i) {
+    seen += DELTA(latency[i]);
+    if (seen * 100 >= total * percent) {
+      if (i == UIO_STATS_BUCKETS - 1)
+        snprintf(buf, len, ">%lluus", (1ULL << (i - 1)) / 1000);
+      else if (i >= 10)
+        snprintf(buf, len, "<%lluus", (1ULL << i) / 1000);
+      else
+        snprintf(buf, len, "<%lluns", 1ULL << i);
+      break;
+    }
+  }
+  return buf;
+}
+
+struct peer_rates {
+  double tx_msgs, tx_bytes, rx_msgs, rx_bytes, doorbells, wakeups;
+  int seen;
+};
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s FILE INTERVAL_MS COUNT\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *filename = argv[1];
+  unsigned int interval_ms = atoi(argv[2]);
+  size_t count = strtoul(argv[3], NULL, 10); /* 0: Until interrupted */
+
+  if (!interval_ms) {
+    fprintf(stderr, "INTERVAL_MS must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "[UIO] Opening file %s...", filename);
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Mapping the file...");
+  size_t pagesize = getpagesize();
+  void *device_mem =
+      mmap(NULL, UIO_RINGS_OFFSET, PROT_READ, MAP_SHARED, fd, pagesize);
+  if (device_mem == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  struct uio_ctrl *ctrl = device_mem;
+  if (atomic_load_explicit(&ctrl->magic, memory_order_acquire) !=
+          UIO_CTRL_MAGIC ||
+      ctrl->version != UIO_CTRL_VERSION) {
+    fprintf(stderr, "No layout version %d found in %s\n", UIO_CTRL_VERSION,
+            filename);
+    exit(EXIT_FAILURE);
+  }
+
+  struct uio_stats *stats[2] = {malloc(sizeof(struct uio_stats)),
+                                malloc(sizeof(struct uio_stats))};
+  struct peer_rates *peers = malloc(MAX_PEERS * sizeof(*peers));
+  if (!stats[0] || !stats[1] || !peers) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  int tty = isatty(STDOUT_FILENO);
+  uint64_t generation = uio_ctrl_generation(ctrl);
+  snapshot(stats[0], uio_ctrl_stats(ctrl));
+  double then = now_s();
+
+  for (size_t n = 0; !count || n < count; ++n) {
+    usleep(interval_ms * 1000);
+
+    struct uio_stats *prev_stats = stats[n & 1], *cur_stats = stats[!(n & 1)];
+    snapshot(cur_stats, uio_ctrl_stats(ctrl));
+    double now = now_s(), elapsed = now - then;
+    then = now;
+
+    /* Reinitialized: The counters restarted from zero. */
+    if (uio_ctrl_generation(ctrl) != generation) {
+      generation = uio_ctrl_generation(ctrl);
+      printf("[generation %lu] Region reinitialized\n", generation);
+      continue;
+    }
+
+    if (tty)
+      printf("\033[H\033[2J");
+    printf("generation %lu / %u rings / %.3f s\n\n", generation,
+           ctrl->nr_rings, elapsed);
+    printf("%4s %4s %5s %10s %10s %8s %8s %8s %8s %7s %8s %8s\n", "RING",
+           "SIDE", "PEER", "MSG/s", "MB/s", "FULL/s", "EMPTY/s", "BELL/s",
+           "WAKE/s", "USED%", "P50", "P99");
+
+    memset(peers, 0, MAX_PEERS * sizeof(*peers));
+    for (unsigned int i = 0; i < ctrl->nr_rings && i < UIO_RING_MAX; ++i) {
+      struct uio_ring *ring = &ctrl->ring[i];
+      double used = 100.0 * uio_ring_used(ring) / ring->size;
+
+      for (int side = 0; side < 2; ++side) {
+        const struct uio_ring_counters *cur = &cur_stats->ring[i][side];
+        const struct uio_ring_counters *prev = &prev_stats->ring[i][side];
+        if (cur->owner == UIO_STATS_NO_OWNER && !cur->messages)
+          continue;
+
+        double msgs = DELTA(messages) / elapsed;
+        double bytes = DELTA(bytes) / elapsed;
+        double doorbells = DELTA(doorbells) / elapsed;
+        double wakeups = DELTA(wakeups) / elapsed;
+        char p50[16], p99[16], owner[8] = "-";
+        if (cur->owner != UIO_STATS_NO_OWNER)
+          snprintf(owner, sizeof(owner), "%lu", cur->owner);
+
+        printf("%4u %4s %5s %10.0f %10.2f %8.0f %8.0f %8.0f %8.0f %7.1f "
+               "%8s %8s\n",
+               i, side == UIO_RING_PRODUCER ? "tx" : "rx", owner, msgs,
+               bytes / 1e6, DELTA(full) / elapsed, DELTA(empty) / elapsed,
+               doorbells, wakeups, used,
+               percentile(cur, prev, 50, p50, sizeof(p50)),
+               percentile(cur, prev, 99, p99, sizeof(p99)));
+
+        if (cur->owner >= MAX_PEERS)
+          continue;
+        struct peer_rates *peer = &peers[cur->owner];
+        if (side == UIO_RING_PRODUCER) {
+          peer->tx_msgs += msgs;
+          peer->tx_bytes += bytes;
+        } else {
+          peer->rx_msgs += msgs;
+          peer->rx_bytes += bytes;
+        }
+        peer->doorbells += doorbells;
+        peer->wakeups += wakeups;
+        peer->seen = 1;
+      }
+    }
+
+    printf("\n%5s %10s %10s %10s %10s %8s %8s\n", "PEER", "TX MSG/s",
+           "TX MB/s", "RX MSG/s", "RX MB/s", "BELL/s", "WAKE/s");
+    for (unsigned int i = 0; i < MAX_PEERS; ++i) {
+      struct peer_rates *peer = &peers[i];
+      if (peer->seen)
+        printf("%5u %10.0f %10.2f %10.0f %10.2f %8.0f %8.0f\n", i,
+               peer->tx_msgs, peer->tx_bytes / 1e6, peer->rx_msgs,
+               peer->rx_bytes / 1e6, peer->doorbells, peer->wakeups);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  free(peers);
+  free(stats[1]);
+  free(stats[0]);
+
+  fprintf(stderr, "[UIO] Unmapping the file...");
+  if (munmap(device_mem, UIO_RINGS_OFFSET)) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Closing the file...");
+  if (close(fd)) {
+    perror("close");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, " Done!\n\n");
+
+  fprintf(stderr, "[UIO] Exiting...\n\n");
+
+  return EXIT_SUCCESS;
+}
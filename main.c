@@ -10,10 +10,14 @@
  *
  */
 
+#include <linux/delay.h>
+#include <linux/kthread.h>
 #include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/platform_device.h>
 #include <linux/uio_driver.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #ifdef CONFIG_AMD_MEM_ENCRYPT
 #include <asm/mem_encrypt.h>
 #endif
@@ -25,24 +29,49 @@ MODULE_AUTHOR("Cam Macdonell");
 MODULE_AUTHOR("Henning Schild");
 MODULE_AUTHOR("Jihong Min");
 
+#define Doorbell 0x0c
+#define IVPosition 0x08
 #define IntrStatus 0x04
 #define IntrMask 0x00
 
 struct ivshmem_info {
   struct uio_info *uio;
-  struct pci_dev *dev;
+  struct pci_dev *dev; /* NULL for the simulated device */
   struct dev_pagemap *devm_pgmap;
+  struct platform_device *sim_pdev;
 };
 
 int intel = 0;
-module_param(intel, int, 0000);
+module_param(intel, int, 0444);
 MODULE_PARM_DESC(intel, "Use optimized method for Intel processor");
 
+unsigned int sim = 0;
+module_param(sim, uint, 0444);
+MODULE_PARM_DESC(sim, "Register a RAM-backed simulated device with this many "
+                      "MiB of shared memory (0: disabled)");
+
+unsigned int sim_ivposition = 0;
+module_param(sim_ivposition, uint, 0444);
+MODULE_PARM_DESC(sim_ivposition, "IVPosition reported by the first simulated "
+                                 "peer; The others follow it");
+
+unsigned int sim_peers = 1;
+module_param(sim_peers, uint, 0444);
+MODULE_PARM_DESC(sim_peers, "Number of simulated peers sharing the shared "
+                            "memory (1 ~ 16)");
+
+unsigned int sim_poll_us = 10;
+module_param(sim_poll_us, uint, 0644);
+MODULE_PARM_DESC(sim_poll_us, "Doorbell polling interval of the simulated "
+                              "device in microseconds (0: busy polling)");
+
 static vm_fault_t uio_ivshmem_vmfault(struct vm_fault *vmf) {
   struct ivshmem_info *this_ivshmem_info = vmf->vma->vm_private_data;
+  void *addr = this_ivshmem_info->uio->mem[1].internal_addr +
+               ((vmf->pgoff - 1) << PAGE_SHIFT);
 
-  vmf->page = virt_to_page(this_ivshmem_info->uio->mem[1].internal_addr +
-                           ((vmf->pgoff - 1) << PAGE_SHIFT));
+  vmf->page =
+      is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
   get_page(vmf->page);
 
   return 0;
@@ -58,6 +87,13 @@ static int uio_ivshmem_mmap(struct uio_info *info, struct vm_area_struct *vma) {
     if (size > PAGE_SIZE)
       return -EINVAL;
 
+    if (!this_ivshmem_info->dev)
+      return remap_pfn_range(
+          vma, vma->vm_start,
+          virt_to_phys((void __force *)info->mem[0].internal_addr) >>
+              PAGE_SHIFT,
+          size, vma->vm_page_prot);
+
     if ((ret = io_remap_pfn_range(
              vma, vma->vm_start,
              pci_resource_start(this_ivshmem_info->dev, 0) >> PAGE_SHIFT, size,
@@ -66,12 +102,12 @@ static int uio_ivshmem_mmap(struct uio_info *info, struct vm_area_struct *vma) {
   }
 
   else {
-    if ((((vma->vm_pgoff - 1) << PAGE_SHIFT) + size) >
-        pci_resource_len(this_ivshmem_info->dev, 2))
+    if ((((vma->vm_pgoff - 1) << PAGE_SHIFT) + size) > info->mem[1].size)
       return -EINVAL;
 
 #ifdef CONFIG_AMD_MEM_ENCRYPT
-    vma->vm_page_prot.pgprot &= ~(sme_me_mask);
+    if (this_ivshmem_info->dev) /* Plain RAM stays encrypted. */
+      vma->vm_page_prot.pgprot &= ~(sme_me_mask);
 #endif
     vma->vm_private_data = this_ivshmem_info;
     vma->vm_ops = &uio_ivshmem_vmops;
@@ -87,6 +123,13 @@ static irqreturn_t ivshmem_handler(int irq, struct uio_info *dev_info) {
 
   ivshmem_info = dev_info->priv;
 
+  if (!ivshmem_info->dev) {
+    /* Simulated; Reading IntrStatus clears it as on the real device. */
+    val = xchg((u32 __force *)(dev_info->mem[0].internal_addr + IntrStatus),
+               0);
+    return val ? IRQ_HANDLED : IRQ_NONE;
+  }
+
   if (ivshmem_info->dev->msix_enabled)
     /* Increment UIO read value; Race will happen here! */
     return IRQ_HANDLED;
@@ -248,6 +291,197 @@ static void ivshmem_pci_remove(struct pci_dev *dev) {
   kfree(info);
 }
 
+/* Simulated device */
+
+#define SIM_DOORBELL_IDLE 0xffffffff
+#define SIM_MAX_PEERS 16
+
+/* SIM_PEERS UIO devices, each with its own registers, over one shmem */
+static struct {
+  void *shmem;
+  unsigned int nr_peers;
+  struct ivshmem_info *peer[SIM_MAX_PEERS];
+  struct task_struct *thread;
+} ivshmem_sim;
+
+static u32 *ivshmem_sim_reg(struct ivshmem_info *ivshmem_info,
+                            unsigned int reg) {
+  return (u32 __force *)(ivshmem_info->uio->mem[0].internal_addr + reg);
+}
+
+/* The peer a doorbell value is addressed to, if it exists */
+static struct ivshmem_info *ivshmem_sim_route(u32 doorbell) {
+  unsigned int dest = doorbell >> 16;
+
+  /* A single peer gets every doorbell back, whatever its destination. */
+  if (ivshmem_sim.nr_peers == 1)
+    return ivshmem_sim.peer[0];
+  if (dest < sim_ivposition || dest - sim_ivposition >= ivshmem_sim.nr_peers)
+    return NULL;
+  return ivshmem_sim.peer[dest - sim_ivposition];
+}
+
+static int ivshmem_sim_thread(void *data) {
+  while (!kthread_should_stop()) {
+    bool busy = false;
+    unsigned int i;
+
+    for (i = 0; i < ivshmem_sim.nr_peers; ++i) {
+      u32 *doorbell = ivshmem_sim_reg(ivshmem_sim.peer[i], Doorbell);
+      struct ivshmem_info *target;
+      u32 val;
+
+      if (READ_ONCE(*doorbell) == SIM_DOORBELL_IDLE ||
+          (val = xchg(doorbell, SIM_DOORBELL_IDLE)) == SIM_DOORBELL_IDLE)
+        continue;
+      busy = true;
+
+      /* Deliver it as an interrupt of the destination, as ivshmem would. */
+      target = ivshmem_sim_route(val);
+      if (!target)
+        continue;
+      WRITE_ONCE(*ivshmem_sim_reg(target, IntrStatus), 1);
+      if (ivshmem_handler(0, target->uio) == IRQ_HANDLED)
+        uio_event_notify(target->uio);
+    }
+    if (busy)
+      continue;
+
+    if (sim_poll_us)
+      usleep_range(sim_poll_us, sim_poll_us * 2);
+    else
+      cond_resched();
+  }
+
+  return 0;
+}
+
+static int ivshmem_sim_add_peer(unsigned int idx) {
+  struct uio_info *info;
+  struct ivshmem_info *ivshmem_info;
+  struct platform_device *pdev;
+  void *regs;
+  int ret = -ENOMEM;
+
+  info = kzalloc(sizeof(struct uio_info), GFP_KERNEL);
+  if (!info)
+    return -ENOMEM;
+
+  ivshmem_info = kzalloc(sizeof(struct ivshmem_info), GFP_KERNEL);
+  if (!ivshmem_info)
+    goto out_free;
+
+  /* Registers */
+
+  regs = (void *)get_zeroed_page(GFP_KERNEL);
+  if (!regs)
+    goto out_free;
+  *(u32 *)(regs + IVPosition) = sim_ivposition + idx;
+  *(u32 *)(regs + Doorbell) = SIM_DOORBELL_IDLE;
+
+  info->mem[0].addr = (phys_addr_t)(uintptr_t)regs;
+  info->mem[0].size = PAGE_SIZE;
+  info->mem[0].internal_addr = (void __iomem __force *)regs;
+  info->mem[0].memtype = UIO_MEM_LOGICAL;
+  info->mem[0].name = "registers";
+
+  /* Shared memory (the same for every peer) */
+
+  info->mem[1].addr = (phys_addr_t)(uintptr_t)ivshmem_sim.shmem;
+  info->mem[1].size = (size_t)sim << 20;
+  info->mem[1].internal_addr = (void __iomem __force *)ivshmem_sim.shmem;
+  info->mem[1].memtype = UIO_MEM_VIRTUAL;
+  info->mem[1].name = "shmem";
+
+  info->mmap = uio_ivshmem_mmap;
+
+  /* IRQ Handler (driven by ivshmem_sim_thread()) */
+
+  info->irq = UIO_IRQ_CUSTOM;
+  info->handler = ivshmem_handler;
+
+  ivshmem_info->uio = info;
+  info->priv = ivshmem_info;
+
+  info->name = "uio_ivshmem";
+  info->version = __PACKAGE_VERSION__;
+
+  pdev = platform_device_register_simple("uio_ivshmem_sim", idx, NULL, 0);
+  if (IS_ERR(pdev)) {
+    ret = PTR_ERR(pdev);
+    goto out_free_regs;
+  }
+
+  if ((ret = uio_register_device(&pdev->dev, info)))
+    goto out_unregister_pdev;
+
+  ivshmem_info->sim_pdev = pdev;
+  ivshmem_sim.peer[idx] = ivshmem_info;
+
+  dev_info(&pdev->dev, "Simulated peer with %u MiB shmem (IVPosition: %u)\n",
+           sim, sim_ivposition + idx);
+
+  return 0;
+out_unregister_pdev:
+  platform_device_unregister(pdev);
+out_free_regs:
+  free_page((unsigned long)regs);
+out_free:
+  kfree(ivshmem_info);
+  kfree(info);
+  return ret;
+}
+
+static void ivshmem_sim_remove_peer(struct ivshmem_info *ivshmem_info) {
+  struct uio_info *info = ivshmem_info->uio;
+
+  uio_unregister_device(info);
+  platform_device_unregister(ivshmem_info->sim_pdev);
+  free_page((unsigned long)info->mem[0].internal_addr);
+  kfree(ivshmem_info);
+  kfree(info);
+}
+
+static void ivshmem_sim_destroy(void) {
+  if (ivshmem_sim.thread)
+    kthread_stop(ivshmem_sim.thread);
+  while (ivshmem_sim.nr_peers)
+    ivshmem_sim_remove_peer(ivshmem_sim.peer[--ivshmem_sim.nr_peers]);
+  vfree(ivshmem_sim.shmem);
+  memset(&ivshmem_sim, 0, sizeof(ivshmem_sim));
+}
+
+static int ivshmem_sim_create(void) {
+  struct task_struct *thread;
+  int ret;
+
+  if (!sim_peers || sim_peers > SIM_MAX_PEERS ||
+      sim_ivposition + sim_peers - 1 > 0xffff)
+    return -EINVAL;
+
+  ivshmem_sim.shmem = vmalloc_user((size_t)sim << 20);
+  if (!ivshmem_sim.shmem)
+    return -ENOMEM;
+
+  while (ivshmem_sim.nr_peers < sim_peers) {
+    if ((ret = ivshmem_sim_add_peer(ivshmem_sim.nr_peers)))
+      goto out_destroy;
+    ++ivshmem_sim.nr_peers;
+  }
+
+  thread = kthread_run(ivshmem_sim_thread, NULL, "uio_ivshmem_sim");
+  if (IS_ERR(thread)) {
+    ret = PTR_ERR(thread);
+    goto out_destroy;
+  }
+  ivshmem_sim.thread = thread;
+
+  return 0;
+out_destroy:
+  ivshmem_sim_destroy();
+  return ret;
+}
+
 static struct pci_device_id ivshmem_pci_ids[] = {{
                                                      .vendor = 0x1af4,
                                                      .device = 0x1110,
@@ -263,5 +497,27 @@ static struct pci_driver ivshmem_pci_driver = {
     .probe = ivshmem_pci_probe,
     .remove = ivshmem_pci_remove,
 };
-module_pci_driver(ivshmem_pci_driver);
+
+static int __init ivshmem_init(void) {
+  int ret;
+
+  if ((ret = pci_register_driver(&ivshmem_pci_driver)))
+    return ret;
+
+  if (sim && (ret = ivshmem_sim_create())) {
+    pci_unregister_driver(&ivshmem_pci_driver);
+    return ret;
+  }
+
+  return 0;
+}
+
+static void __exit ivshmem_exit(void) {
+  if (ivshmem_sim.shmem)
+    ivshmem_sim_destroy();
+  pci_unregister_driver(&ivshmem_pci_driver);
+}
+
+module_init(ivshmem_init);
+module_exit(ivshmem_exit);
 MODULE_DEVICE_TABLE(pci, ivshmem_pci_ids);